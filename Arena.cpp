@@ -0,0 +1,67 @@
+#include "Arena.h"
+
+Arena::Arena(size_t spanPages)
+        : _spanPages(spanPages > 0 ? spanPages : 1) {
+}
+
+Arena::~Arena() {
+    Reset();
+}
+
+void *
+Arena::Allocate(size_t size, size_t align) {
+    assert (align > 0 && (align & (align - 1)) == 0);
+    assert (align <= ((size_t) 1 << PAGE_SHIFT));
+
+    char *ptr = (char *) (((size_t) _ptr + align - 1) & ~(align - 1));
+    if (_ptr == nullptr || ptr + size > _end) {
+        NewBlock(size, align);
+        ptr = (char *) (((size_t) _ptr + align - 1) & ~(align - 1));
+    }
+    _ptr = ptr + size;
+    _bytesAllocated += size;
+    return ptr;
+}
+
+void
+Arena::NewBlock(size_t size, size_t align) {
+    size_t npage = (size + align + ((size_t) 1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+    if (npage < _spanPages) {
+        npage = _spanPages;
+    }
+
+    PageCache::GetInstance()->Lock();
+    Span *span = PageCache::GetInstance()->NewSpan(npage);
+    span->_objsize = 0;
+    span->_zeroed = false;
+    PageCache::GetInstance()->UnLock();
+
+    // span不在任何SpanList中，借用_next串起来
+    span->_next = _spans;
+    _spans = span;
+    ++_spanCount;
+
+    _ptr = (char *) (span->_pageid << PAGE_SHIFT);
+    _end = _ptr + (span->_npage << PAGE_SHIFT);
+}
+
+void
+Arena::Reset() {
+    if (_spans == nullptr) {
+        return;
+    }
+
+    // 所有span在一次加锁中还给pc
+    PageCache::GetInstance()->Lock();
+    while (_spans) {
+        Span *next = _spans->_next;
+        _spans->_next = nullptr;
+        PageCache::GetInstance()->ReleaseSpanToPageCache(_spans);
+        _spans = next;
+    }
+    PageCache::GetInstance()->UnLock();
+
+    _ptr = _end = nullptr;
+    _bytesAllocated = 0;
+    _spanCount = 0;
+}
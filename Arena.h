@@ -0,0 +1,47 @@
+#ifndef MEMORY_POOL_ARENA_H
+#define MEMORY_POOL_ARENA_H
+
+#include "PageCache.h"
+
+// 区域（arena）分配器：适合一次请求中申请大量小对象、请求结束时一起释放的场景
+// 直接向pc要span，在span上移动指针分配，不经过tc和cc，单个对象不能释放
+// Reset或析构时把所有span一次还给pc，耗时和span个数成正比，和对象个数无关
+// 不加锁，一个arena只能在一个线程中使用；对象的析构函数不会被调用
+class Arena {
+public:
+    // spanPages：每次向pc要的页数，单次申请更大时按需要的页数要
+    explicit Arena(size_t spanPages = 8);
+    ~Arena();
+
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // 申请size字节，起始地址按align（2的幂，不超过一页）对齐
+    void *Allocate(size_t size, size_t align = sizeof(void *));
+
+    // 把所有span还给pc，之前申请的内存全部失效
+    void Reset();
+
+    // 已经分配出去的字节数（不含对齐的空隙）
+    size_t BytesAllocated() const {
+        return _bytesAllocated;
+    }
+
+    // 当前持有的span数
+    size_t SpanCount() const {
+        return _spanCount;
+    }
+
+private:
+    // 向pc要一个至少能放下size + align字节的span
+    void NewBlock(size_t size, size_t align);
+
+    size_t _spanPages;
+    Span *_spans = nullptr;     // 持有的span，通过_next串起来
+    char *_ptr = nullptr;       // 当前span中下一个可用的位置
+    char *_end = nullptr;       // 当前span的末尾
+    size_t _bytesAllocated = 0;
+    size_t _spanCount = 0;
+};
+
+#endif //MEMORY_POOL_ARENA_H
@@ -0,0 +1,399 @@
+/*基准测试程序：memory_pool_bench
+  - 用steady_clock计时，统计的是每个线程的墙上时间，而不是clock()的进程CPU时间
+  - 线程数从1扫到nproc
+  - 多种size分布：fixed / uniform / powerlaw / large
+  - 同一负载分别跑glibc malloc和ConcurrentAlloc
+  - 结果按CSV输出，方便不同版本之间对比
+  - 节点容器（map / unordered_map / list）分别用std::allocator和PoolAllocator跑同样的插入删除
+  - pc单独测NewSpan / ReleaseSpanToPageCache，看持有pc锁的时间
+
+  用法：memory_pool_bench [--threads N] [--ops N] [--rounds N] [--dist NAME] [--alloc NAME]
+                          [--container NAME] [--suite alloc|container|pagecache|all]
+  NAME为all时跑全部，默认全部；每组测试各自输出一个CSV表头*/
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <list>
+#include <map>
+#include <random>
+#include <string>
+#include <string.h>
+#include <unordered_map>
+#include "ConcurrentAlloc.h"
+#include "PoolAllocator.h"
+
+// 一种被测的分配器
+struct Allocator {
+    const char* _name;
+    void* (*_alloc)(size_t);
+    void (*_free)(void*, size_t);
+};
+
+static void* MallocAlloc(size_t size) {
+    return malloc(size);
+}
+
+static void MallocFree(void* ptr, size_t) {
+    free(ptr);
+}
+
+static void* PoolAlloc(size_t size) {
+    return ConcurrentAlloc(size);
+}
+
+static void PoolFree(void* ptr, size_t) {
+    ConcurrentFree(ptr);
+}
+
+static void PoolSizedFree(void* ptr, size_t size) {
+    ConcurrentFree(ptr, size);
+}
+
+static const Allocator allocators[] = {
+        {"malloc",           MallocAlloc, MallocFree},
+        {"concurrent",       PoolAlloc,   PoolFree},
+        {"concurrent_sized", PoolAlloc,   PoolSizedFree},
+};
+
+// 一种size分布，按线程的随机数引擎生成size
+struct Distribution {
+    const char* _name;
+    size_t (*_next)(std::mt19937_64&);
+};
+
+// 每次都是同一个桶
+static size_t FixedSize(std::mt19937_64&) {
+    return 16;
+}
+
+// [1, 8K]均匀分布
+static size_t UniformSize(std::mt19937_64& rng) {
+    return rng() % (8 * 1024) + 1;
+}
+
+// 幂律分布：小对象居多，偶尔有接近MAX_BYTES的对象，接近真实程序
+static size_t PowerLawSize(std::mt19937_64& rng) {
+    std::uniform_real_distribution<double> u(0.0, 1.0);
+    // 帕累托分布，alpha = 1.2，最小8字节
+    double size = 8.0 / pow(1.0 - u(rng), 1.0 / 1.2);
+    if (size > MAX_BYTES) {
+        size = MAX_BYTES;
+    }
+    return (size_t) size;
+}
+
+// 大对象：(256K, 4M]，走pc
+static size_t LargeSize(std::mt19937_64& rng) {
+    return MAX_BYTES + 1 + rng() % (4 * 1024 * 1024 - MAX_BYTES);
+}
+
+static const Distribution distributions[] = {
+        {"fixed",    FixedSize},
+        {"uniform",  UniformSize},
+        {"powerlaw", PowerLawSize},
+        {"large",    LargeSize},
+};
+
+// 一次测试的结果
+struct Result {
+    double _allocSeconds = 0;   // 所有线程中最慢的申请耗时
+    double _freeSeconds = 0;    // 所有线程中最慢的释放耗时
+};
+
+// nworks个线程，每个线程rounds轮，每轮申请ntimes次再全部释放
+static Result RunOne(const Allocator& allocator, const Distribution& dist,
+                     size_t nworks, size_t ntimes, size_t rounds) {
+    std::vector<std::thread> vthread(nworks);
+    std::vector<Result> results(nworks);
+    std::atomic<size_t> ready = {0};
+
+    for (size_t k = 0; k < nworks; ++k) {
+        vthread[k] = std::thread([&, k]() {
+            // size提前生成好，随机数的开销不计入
+            std::mt19937_64 rng(k + 1);
+            std::vector<size_t> sizes(ntimes);
+            for (size_t i = 0; i < ntimes; ++i) {
+                sizes[i] = dist._next(rng);
+            }
+            std::vector<void*> v(ntimes);
+
+            // 所有线程准备好之后一起开始
+            ++ready;
+            while (ready.load() < nworks) {
+                std::this_thread::yield();
+            }
+
+            std::chrono::steady_clock::duration allocTime{0};
+            std::chrono::steady_clock::duration freeTime{0};
+            for (size_t j = 0; j < rounds; ++j) {
+                auto begin1 = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < ntimes; ++i) {
+                    v[i] = allocator._alloc(sizes[i]);
+                    *(char*) v[i] = (char) i;     // 写一下，避免只测到虚拟地址
+                }
+                auto end1 = std::chrono::steady_clock::now();
+
+                auto begin2 = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < ntimes; ++i) {
+                    allocator._free(v[i], sizes[i]);
+                }
+                auto end2 = std::chrono::steady_clock::now();
+
+                allocTime += end1 - begin1;
+                freeTime += end2 - begin2;
+            }
+            results[k]._allocSeconds = std::chrono::duration<double>(allocTime).count();
+            results[k]._freeSeconds = std::chrono::duration<double>(freeTime).count();
+        });
+    }
+
+    for (auto& t : vthread) {
+        t.join();
+    }
+
+    Result total;
+    for (auto& r : results) {
+        total._allocSeconds = std::max(total._allocSeconds, r._allocSeconds);
+        total._freeSeconds = std::max(total._freeSeconds, r._freeSeconds);
+    }
+    return total;
+}
+
+// 节点容器的负载：插入keys中的所有元素，再全部删除
+template<template<class> class Alloc>
+static void MapWork(const std::vector<size_t>& keys) {
+    std::map<size_t, size_t, std::less<size_t>, Alloc<std::pair<const size_t, size_t>>> m;
+    for (size_t key : keys) {
+        m[key] = key;
+    }
+    for (size_t key : keys) {
+        m.erase(key);
+    }
+}
+
+template<template<class> class Alloc>
+static void UnorderedMapWork(const std::vector<size_t>& keys) {
+    std::unordered_map<size_t, size_t, std::hash<size_t>, std::equal_to<size_t>,
+            Alloc<std::pair<const size_t, size_t>>> m;
+    for (size_t key : keys) {
+        m[key] = key;
+    }
+    for (size_t key : keys) {
+        m.erase(key);
+    }
+}
+
+template<template<class> class Alloc>
+static void ListWork(const std::vector<size_t>& keys) {
+    std::list<size_t, Alloc<size_t>> l;
+    for (size_t key : keys) {
+        l.push_back(key);
+    }
+    while (!l.empty()) {
+        l.pop_front();
+    }
+}
+
+// 一种节点容器，分别用std::allocator和PoolAllocator实例化
+struct ContainerBench {
+    const char* _name;
+    void (*_std)(const std::vector<size_t>&);
+    void (*_pool)(const std::vector<size_t>&);
+};
+
+static const ContainerBench containers[] = {
+        {"map",           MapWork<std::allocator>,          MapWork<PoolAllocator>},
+        {"unordered_map", UnorderedMapWork<std::allocator>, UnorderedMapWork<PoolAllocator>},
+        {"list",          ListWork<std::allocator>,         ListWork<PoolAllocator>},
+};
+
+// nworks个线程，每个线程rounds轮，每轮插入ntimes个元素再全部删除，返回最慢线程的耗时
+static double RunContainer(void (*work)(const std::vector<size_t>&),
+                           size_t nworks, size_t ntimes, size_t rounds) {
+    std::vector<std::thread> vthread(nworks);
+    std::vector<double> seconds(nworks);
+    std::atomic<size_t> ready = {0};
+
+    for (size_t k = 0; k < nworks; ++k) {
+        vthread[k] = std::thread([&, k]() {
+            std::mt19937_64 rng(k + 1);
+            std::vector<size_t> keys(ntimes);
+            for (size_t i = 0; i < ntimes; ++i) {
+                keys[i] = rng();
+            }
+
+            ++ready;
+            while (ready.load() < nworks) {
+                std::this_thread::yield();
+            }
+
+            auto begin = std::chrono::steady_clock::now();
+            for (size_t j = 0; j < rounds; ++j) {
+                work(keys);
+            }
+            auto end = std::chrono::steady_clock::now();
+            seconds[k] = std::chrono::duration<double>(end - begin).count();
+        });
+    }
+
+    for (auto& t : vthread) {
+        t.join();
+    }
+    double total = 0;
+    for (double s : seconds) {
+        total = std::max(total, s);
+    }
+    return total;
+}
+
+// pc的负载：页数的分布
+struct PageDistribution {
+    const char* _name;
+    size_t _maxPages;   // 页数在[1, _maxPages]中均匀分布
+};
+
+static const PageDistribution pageDistributions[] = {
+        {"single", 1},        // cc切8字节到1K的桶：每次都从128页的大span头部切1页，中间的桶都是空的
+        {"small", 8},
+        {"mixed", NPAGES - 1},
+};
+
+// 单线程：每批申请PC_BATCH个span，再打乱顺序全部还回去，和cc一样每次操作都加锁解锁
+// 返回总耗时（秒），ops是NewSpan的次数
+static double RunPageCache(const PageDistribution& dist, size_t ops, size_t rounds) {
+    static const size_t PC_BATCH = 1024;
+    std::mt19937_64 rng(1);
+    std::vector<size_t> pages(ops);
+    for (size_t i = 0; i < ops; ++i) {
+        pages[i] = rng() % dist._maxPages + 1;
+    }
+    std::vector<Span*> spans;
+    spans.reserve(PC_BATCH);
+    PageCache* pc = PageCache::GetInstance();
+
+    std::chrono::steady_clock::duration time{0};
+    for (size_t j = 0; j < rounds; ++j) {
+        for (size_t i = 0; i < ops; i += PC_BATCH) {
+            size_t n = std::min(PC_BATCH, ops - i);
+            auto begin1 = std::chrono::steady_clock::now();
+            for (size_t k = 0; k < n; ++k) {
+                pc->Lock();
+                spans.push_back(pc->NewSpan(pages[i + k]));
+                pc->UnLock();
+            }
+            auto end1 = std::chrono::steady_clock::now();
+
+            // 打乱的时间不计入
+            std::shuffle(spans.begin(), spans.end(), rng);
+            auto begin2 = std::chrono::steady_clock::now();
+            for (Span* span : spans) {
+                pc->Lock();
+                pc->ReleaseSpanToPageCache(span);
+                pc->UnLock();
+            }
+            auto end2 = std::chrono::steady_clock::now();
+            spans.clear();
+            time += (end1 - begin1) + (end2 - begin2);
+        }
+    }
+    return std::chrono::duration<double>(time).count();
+}
+
+static bool Match(const char* filter, const char* name) {
+    return strcmp(filter, "all") == 0 || strcmp(filter, name) == 0;
+}
+
+int main(int argc, char* argv[]) {
+    long nproc = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t maxThreads = nproc > 0 ? (size_t) nproc : 1;
+    size_t ntimes = 10000;
+    size_t rounds = 10;
+    const char* distFilter = "all";
+    const char* allocFilter = "all";
+    const char* containerFilter = "all";
+    const char* suite = "all";
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--threads") == 0) {
+            maxThreads = strtoul(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--ops") == 0) {
+            ntimes = strtoul(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--rounds") == 0) {
+            rounds = strtoul(argv[i + 1], nullptr, 10);
+        } else if (strcmp(argv[i], "--dist") == 0) {
+            distFilter = argv[i + 1];
+        } else if (strcmp(argv[i], "--alloc") == 0) {
+            allocFilter = argv[i + 1];
+        } else if (strcmp(argv[i], "--container") == 0) {
+            containerFilter = argv[i + 1];
+        } else if (strcmp(argv[i], "--suite") == 0) {
+            suite = argv[i + 1];
+        } else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (Match(suite, "alloc")) {
+        printf("allocator,distribution,threads,ops,alloc_seconds,free_seconds,mops_per_sec,ns_per_op\n");
+    }
+    for (auto& dist : distributions) {
+        if (!Match(suite, "alloc") || !Match(distFilter, dist._name)) {
+            continue;
+        }
+        // 大对象每次都要进pc，次数少一点
+        size_t ops = strcmp(dist._name, "large") == 0 ? std::max<size_t>(ntimes / 20, 1) : ntimes;
+        for (size_t nworks = 1; nworks <= maxThreads; ++nworks) {
+            for (auto& allocator : allocators) {
+                if (!Match(allocFilter, allocator._name)) {
+                    continue;
+                }
+                Result r = RunOne(allocator, dist, nworks, ops, rounds);
+                // 每次申请和释放各算一次操作
+                size_t totalOps = 2 * nworks * ops * rounds;
+                double seconds = r._allocSeconds + r._freeSeconds;
+                printf("%s,%s,%zu,%zu,%.6f,%.6f,%.3f,%.2f\n",
+                       allocator._name, dist._name, nworks, totalOps,
+                       r._allocSeconds, r._freeSeconds,
+                       totalOps / seconds / 1e6, seconds * 1e9 * nworks / totalOps);
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (Match(suite, "container")) {
+        printf("allocator,container,threads,ops,seconds,mops_per_sec,ns_per_op\n");
+    }
+    for (auto& container : containers) {
+        if (!Match(suite, "container") || !Match(containerFilter, container._name)) {
+            continue;
+        }
+        for (size_t nworks = 1; nworks <= maxThreads; ++nworks) {
+            const char* names[2] = {"std_allocator", "pool_allocator"};
+            void (*works[2])(const std::vector<size_t>&) = {container._std, container._pool};
+            for (int a = 0; a < 2; ++a) {
+                double seconds = RunContainer(works[a], nworks, ntimes, rounds);
+                // 每个元素的插入和删除各算一次操作
+                size_t totalOps = 2 * nworks * ntimes * rounds;
+                printf("%s,%s,%zu,%zu,%.6f,%.3f,%.2f\n",
+                       names[a], container._name, nworks, totalOps, seconds,
+                       totalOps / seconds / 1e6, seconds * 1e9 * nworks / totalOps);
+                fflush(stdout);
+            }
+        }
+    }
+
+    if (Match(suite, "pagecache")) {
+        printf("suite,pages,ops,seconds,mops_per_sec,ns_per_op\n");
+        for (auto& dist : pageDistributions) {
+            double seconds = RunPageCache(dist, ntimes, rounds);
+            // 每次NewSpan和ReleaseSpanToPageCache各算一次操作
+            size_t totalOps = 2 * ntimes * rounds;
+            printf("pagecache,%s,%zu,%.6f,%.3f,%.2f\n",
+                   dist._name, totalOps, seconds, totalOps / seconds / 1e6, seconds * 1e9 / totalOps);
+            fflush(stdout);
+        }
+    }
+    return 0;
+}
@@ -1,33 +1,134 @@
 #include "CentralCache.h"
 #include "PageCache.h"
+#include "CpuCache.h"
+#include "MemoryChecker.h"
 
 // 单例
 CentralCache CentralCache::_inst;
 
-// 让cc拿到一个spanlist下非空的span
+bool
+TransferCache::Insert(void *start, void *end, size_t count, size_t size) {
+    // 批太大的不缓存，和按字节算的上限一起限制住transfer cache占用的内存
+    size_t maxCount = 2 * SizeClass::NumMoveSize(size);
+    if (count > maxCount) {
+        return false;
+    }
+    size_t maxBatches = MAX_BYTES_CACHED / (maxCount * size);
+    if (maxBatches < 1) {
+        maxBatches = 1;
+    }
+    if (maxBatches > MAX_BATCHES) {
+        maxBatches = MAX_BATCHES;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_nbatch >= maxBatches) {
+        return false;
+    }
+    TransferBatch &batch = _batches[_nbatch++];
+    batch._start = start;
+    batch._end = end;
+    batch._count = count;
+    _objs += count;
+    ++_insertCount;
+    return true;
+}
+
+size_t
+TransferCache::Remove(void *&start, void *&end, size_t batchNum) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_nbatch == 0 || _batches[_nbatch - 1]._count > 2 * batchNum) {
+        return 0;
+    }
+    TransferBatch &batch = _batches[--_nbatch];
+    if (_nbatch < _lowater) {
+        _lowater = _nbatch;
+    }
+    start = batch._start;
+    end = batch._end;
+    _objs -= batch._count;
+    ++_removeCount;
+    return batch._count;
+}
+
+size_t
+TransferCache::Plunder(void *&start, bool idleOnly) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    // 栈底的批最早放进来，idleOnly时只取栈底一直没动过的_lowater批，剩下的往下挪
+    size_t n = idleOnly ? _lowater : _nbatch;
+    size_t count = 0;
+    start = nullptr;
+    for (size_t i = 0; i < n; ++i) {
+        TransferBatch &batch = _batches[i];
+        NEXT_OBJ(batch._end) = start;
+        start = batch._start;
+        count += batch._count;
+    }
+    for (size_t i = n; i < _nbatch; ++i) {
+        _batches[i - n] = _batches[i];
+    }
+    _nbatch -= n;
+    _lowater = _nbatch;
+    _objs -= count;
+    return count;
+}
+
+void
+TransferCache::GetStats(SizeClassStats &stats) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    stats._transferObjs += _objs;
+    stats._fetchCount += _removeCount;
+    stats._releaseCount += _insertCount;
+}
+
+size_t
+CentralCache::HomeShard() {
+    if (CpuCache::Enabled()) {
+        return CpuCache::CurrentCpu() % CENTRAL_SHARDS;
+    }
+    // 线程第一次用cc时轮流分配，之后一直用同一个分片
+    static std::atomic<size_t> nextShard{0};
+    static thread_local size_t tlsShard = CENTRAL_SHARDS;
+    if (tlsShard == CENTRAL_SHARDS) {
+        tlsShard = nextShard.fetch_add(1, std::memory_order_relaxed) % CENTRAL_SHARDS;
+    }
+    return tlsShard;
+}
+
+// 让cc拿到桶index下一个非空的span
 Span *
-CentralCache::GetOneSpan(SpanList &spanlist, size_t size) {
-    // 1. 判断cc对应index下挂的有没有管理非空空间的span，
+CentralCache::GetOneSpan(size_t index, CentralShard *&shard, size_t size) {
+    // 1. 判断本线程的分片下挂的有没有管理非空空间的span，
     // 2. 有：将该span返回
-    // 3. 没有：向pc申请新的span（调用NewSpan即可）
+    // 3. 没有：看相邻的分片，都没有再向pc申请新的span（调用NewSpan即可）
+    size_t home = HomeShard();
+    PageID hint = 0;
 
-    Span *it = spanlist.Begin();
-    while (it != spanlist.End()) {
-        if (it->_list != nullptr)
-            return it;
-        else
-            it = it->_next;
+    // spanlist中只挂有空闲内存块的span，第一个就能用，不需要遍历
+    // 本分片没有时先从相邻的分片拿，避免各个分片都向pc申请span，空闲的内存块散落在各个分片中
+    for (size_t i = 0; i < CENTRAL_SHARDS; ++i) {
+        shard = &_shards[index][(home + i) % CENTRAL_SHARDS];
+        // cc加锁1：取分片中的span
+        shard->_spanlist.Lock();
+        if (!shard->_spanlist.Empty()) {
+            return shard->_spanlist.Begin();
+        }
+        if (i == 0) {
+            hint = shard->_lastSpanPage;
+        }
+        // 解锁cc1：这个分片中没有非空span
+        shard->_spanlist.Unlock();
     }
 
-    // cc中有非空span已经在上面return了，没有return的话，说明cc中没有非空span，下面向pc中申请
-    // 解锁cc1：cc中没有非空span
-    spanlist.Unlock();
+    // 所有分片中都没有非空span，下面向pc中申请，切好后挂到本线程的分片
+    shard = &_shards[index][home];
     size_t k = SizeClass::NumMovePage(size);
 
     // pc加锁解锁1：cc向pc申请是span
     PageCache::GetInstance()->Lock();
-    Span *span = PageCache::GetInstance()->NewSpan(k);    // 此时的span还没有被划分
+    Span *span = PageCache::GetInstance()->NewSpan(k, hint);    // 此时的span还没有被划分
     span->_isUse = true;
+    span->_zeroed = false;      // 下面切分时要写链表指针
     PageCache::GetInstance()->UnLock();
 
     // 划分span：
@@ -43,22 +144,34 @@ CentralCache::GetOneSpan(SpanList &spanlist, size_t size) {
     char *start = (char *) (span->_pageid << PAGE_SHIFT);
     char *end = (char *) (start + (span->_npage << PAGE_SHIFT));
     span->_objsize = size;
+    span->_shard = home;
     span->_list = start;
     void *tail = start;
+    size_t nobj = 1;
 
     start += size;
 
-    while (start < end) {
+    while (start + size <= end) {      // 最后不够一个size的尾巴不切，避免越过span的末尾
         NEXT_OBJ(tail) = start;
         start += size;
         tail = NEXT_OBJ(tail);
+        ++nobj;
     }
     NEXT_OBJ(tail) = nullptr;
     // 获得了划分好的span，但该span不在对应的spanlist中
+#ifdef MEMPOOL_CHECKED
+    MemoryChecker::OnSpanCarved(span, nobj);
+#endif
 
     // cc加锁2：把切好的span挂到cc中去时
-    spanlist.Lock();
-    spanlist.PushFront(span);
+    shard->_spanlist.Lock();
+    shard->_spanlist.PushFront(span);
+    shard->_lastSpanPage = span->_pageid;
+
+    ClassStats &stats = shard->_stats;
+    ++stats._spans;
+    stats._totalObjs += nobj;
+    stats._freeObjs += nobj;
     return span;
 }
 
@@ -67,18 +180,21 @@ size_t
 CentralCache::FetchRangeObj(void *&start, void *&end, size_t batchNum, size_t size) {
     // 找size对应的spanlist
     size_t index = SizeClass::Index(size);
-    SpanList &spanlist = _spanlist[index];
+
+    // 先看transfer cache中有没有别的tc还回来的整批内存块，有就整批拿走
+    size_t batchCount = _transfer[index].Remove(start, end, batchNum);
+    if (batchCount > 0) {
+        return batchCount;
+    }
 
     // _spanlist[index]所挂载的span的情况：
     // 1. 有span且span所管理的空间不为空：直接获取到这个管理空间非空的span即可。
     // 2. 有span但span所管理的空间为空：向pc申请一个新的span。
     // 2. 没有span：向pc申请一个新的span。
 
-    // cc加锁1：取cc自己哈希桶中的span时
-    spanlist.Lock();
-
-    // 获得一个当前spanlist下，有挂载内存块的span
-    Span *span = GetOneSpan(spanlist, size);
+    // 获得一个有挂载内存块的span，同时持有它所在分片的锁
+    CentralShard *shard = nullptr;
+    Span *span = GetOneSpan(index, shard, size);
     assert (span);
     assert (span->_list);
 
@@ -100,47 +216,134 @@ CentralCache::FetchRangeObj(void *&start, void *&end, size_t batchNum, size_t si
     span->_usecount += actualNum;
     NEXT_OBJ(end) = nullptr;
 
+    shard->_stats._freeObjs -= actualNum;
+    ++shard->_stats._fetchCount;
+
+    // span中的内存块分完了，挪到full链表中
+    if (span->_list == nullptr) {
+        shard->_spanlist.Erase(span);
+        shard->_fullspanlist.PushFront(span);
+    }
+
     // cc解锁2：切分后的span交给需要的tc之后
-    spanlist.Unlock();
+    shard->_spanlist.Unlock();
 
     return actualNum;
 }
 
 void
-CentralCache:: ReleaseListToSpans(void *start, size_t size) {
+CentralCache::ReleaseRange(void *start, void *end, size_t n, size_t size) {
     size_t index = SizeClass::Index(size);
-    SpanList& spanlist = _spanlist[index];
+    if (_transfer[index].Insert(start, end, n, size)) {
+        return;
+    }
+    ReleaseListToSpans(start, size);
+}
+
+size_t
+CentralCache::ReleaseTransferCaches(bool idleOnly) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < NLISTS; ++i) {
+        void *start = nullptr;
+        size_t count = _transfer[i].Plunder(start, idleOnly);
+        if (count > 0) {
+            size_t size = SizeClass::ClassSize(i);
+            ReleaseListToSpans(start, size);
+            bytes += count * size;
+        }
+    }
+    return bytes;
+}
 
-    // cc加锁3
-    spanlist.Lock();
+void
+CentralCache:: ReleaseListToSpans(void *start, size_t size) {
+    size_t index = SizeClass::Index(size);
+    // 一批内存块可能来自不同分片的span，按span所在的分片加锁，相邻的内存块在同一分片时不重复加锁
+    CentralShard *shard = nullptr;
+    bool counted = false;
 
     while (start) {
         Span* span = PageCache::GetInstance()->MapObjectToSpan(start);
         void* next = NEXT_OBJ(start);
+        CentralShard *spanShard = &_shards[index][span->_shard];
+        if (spanShard != shard) {
+            // cc加锁3
+            if (shard) {
+                shard->_spanlist.Unlock();
+            }
+            shard = spanShard;
+            shard->_spanlist.Lock();
+            if (!counted) {
+                ++shard->_stats._releaseCount;
+                counted = true;
+            }
+        }
+        SpanList &spanlist = shard->_spanlist;
+        ClassStats &stats = shard->_stats;
+        // span之前是满的，现在有了空闲内存块，挪回spanlist
+        if (span->_list == nullptr) {
+            shard->_fullspanlist.Erase(span);
+            spanlist.PushFront(span);
+        }
         NEXT_OBJ(start) = span->_list;
         span->_list = start;
         span->_usecount -- ;
+        ++stats._freeObjs;
         if (span->_usecount == 0) {
             spanlist.Erase(span);
+            // span整个还给pc，切出的内存块数和切分时一样
+            size_t nobj = (span->_npage << PAGE_SHIFT) / span->_objsize;
+            --stats._spans;
+            stats._totalObjs -= nobj;
+            stats._freeObjs -= nobj;
             span->_list = nullptr;
             span->_next = nullptr;
             span->_prev = nullptr;
+#ifdef MEMPOOL_CHECKED
+            MemoryChecker::OnSpanReleased(span);
+#endif
 
             // 归还span，解锁4
             spanlist.Unlock();
+            shard = nullptr;    // 下一个内存块重新加锁
 
             // pc加锁解锁2：cc归还span给pc
             PageCache::GetInstance()->Lock();
             PageCache::GetInstance()->ReleaseSpanToPageCache(span);
             PageCache::GetInstance()->UnLock();
-
-            // 归还完毕，加锁4
-            spanlist.Lock();
         }
         start = next;
     }
 
     // cc解锁3
-    spanlist.Unlock();
+    if (shard) {
+        shard->_spanlist.Unlock();
+    }
 }
 
+void
+CentralCache::GetStats(MemoryPoolStats &stats) {
+    for (size_t i = 0; i < NLISTS; ++i) {
+        SizeClassStats &out = stats._sizeClasses[i];
+        out._objsize = SizeClass::ClassSize(i);
+
+        size_t totalObjs = 0;
+        for (CentralShard &shard : _shards[i]) {
+            shard._spanlist.Lock();
+            const ClassStats &in = shard._stats;
+            out._centralSpans += in._spans;
+            out._centralFreeObjs += in._freeObjs;
+            out._fetchCount += in._fetchCount;
+            out._releaseCount += in._releaseCount;
+            totalObjs += in._totalObjs;
+            shard._spanlist.Unlock();
+        }
+
+        _transfer[i].GetStats(out);
+
+        // span切出的内存块，不在cc、transfer cache和tc中的，就在应用程序手里
+        // 各部分不是同一时刻读的，可能有短暂的偏差
+        size_t cached = out._centralFreeObjs + out._transferObjs + out._threadCacheObjs;
+        out._appObjs = totalObjs > cached ? totalObjs - cached : 0;
+    }
+}
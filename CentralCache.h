@@ -2,12 +2,52 @@
 #define MEMORY_POOL_CENTRALCACHE_H
 
 #include "common.h"
+#include "MemoryStats.h"
 
 // ThreadCache:
 // 资源过剩时，回收当前ThreadCache内部的的内存，分配给其他ThreadCache
 // 只有一个中心缓存：所有的线程在一个中心缓存获取内存，所以中心缓存可以使用单例模式创建类
 // 要加锁
 
+// 一批内存块：start ... end 串成的链表，共count个
+struct TransferBatch {
+    void *_start = nullptr;
+    void *_end = nullptr;
+    size_t _count = 0;
+};
+
+// transfer cache：cc每个桶前面挂一个批的栈
+// tc还回来的一整批内存块原样放进来，另一个tc来取时原样拿走，不需要拆成单个内存块挂回span
+class TransferCache {
+private:
+    static const size_t MAX_BATCHES = 64;   // 每个桶最多缓存的批数
+    static const size_t MAX_BYTES_CACHED = 1024 * 1024;  // 每个桶最多缓存的字节数
+
+    TransferBatch _batches[MAX_BATCHES];
+    size_t _nbatch = 0;
+    size_t _lowater = 0;       // 上次Plunder以来_nbatch的最小值，栈底这么多批一直没被取走
+    std::mutex _mutex;
+
+    // 统计，在_mutex内修改
+    size_t _objs = 0;          // 缓存的内存块总数
+    size_t _insertCount = 0;   // 放入的批数
+    size_t _removeCount = 0;   // 取出的批数
+
+public:
+    // 放入一批，放不下返回false，由调用方还给span
+    bool Insert(void *start, void *end, size_t count, size_t size);
+
+    // 取出一批，没有合适的批返回0
+    // 只取不超过batchNum两倍的批，避免慢启动阶段的tc一次拿走太多
+    size_t Remove(void *&start, void *&end, size_t batchNum);
+
+    // 取出缓存的批串成一条以nullptr结尾的链表，返回内存块数，由调用方还给span
+    // idleOnly：只取上次Plunder以来一直没被取走的批，否则全部取出
+    size_t Plunder(void *&start, bool idleOnly);
+
+    void GetStats(SizeClassStats &stats);
+};
+
 // 单例，懒汉
 class CentralCache {
 public:
@@ -16,10 +56,30 @@ public:
         return &_inst;
     }
 
-    // 让cc拿到一个spanlist下非空的span
-    // cc有非空span：将该span返回
-    // cc没有非空span：向pc申请新的span
-    Span *GetOneSpan(SpanList &spanlist, size_t size);
+private:
+    // 每个桶的统计，在所在分片的_spanlist锁内修改
+    struct ClassStats {
+        size_t _spans = 0;        // span数
+        size_t _totalObjs = 0;    // 这些span一共切出的内存块数
+        size_t _freeObjs = 0;     // span上空闲的内存块数
+        size_t _fetchCount = 0;   // 从span上给tc内存块的次数
+        size_t _releaseCount = 0; // tc还回span的次数
+    };
+
+    // 桶的一个分片：热门的桶所有线程抢一把锁，分成几片后不同线程（cpu cache打开时不同CPU）用不同的分片
+    // span分两条链表：还有空闲内存块的和已经全部分出去的，两条链表共用_spanlist的锁
+    struct alignas(64) CentralShard {
+        SpanList _spanlist;       // 只挂还有空闲内存块的span
+        SpanList _fullspanlist;   // 内存块已经全部分配出去的span
+        ClassStats _stats;
+        PageID _lastSpanPage = 0; // 上一次向pc申请到的span的页号，作为NewSpan的hint
+    };
+
+public:
+    // 让cc拿到桶index下一个非空的span，返回时持有span所在分片的锁，shard指向这个分片
+    // 本线程的分片有非空span：将该span返回
+    // 没有：依次找相邻的分片，都没有才向pc申请新的span，挂到本线程的分片
+    Span *GetOneSpan(size_t index, CentralShard *&shard, size_t size);
 
     // 给thread cache一定数量的对象
 //    从CentralCache对应index下标的哈希桶中拿出batchNum块大小为Size的块空间
@@ -35,14 +95,29 @@ public:
 
     // 将tc还回来的多块空间放到span中
     void ReleaseListToSpans(void *start, size_t size);
+
+    // tc还回来一批[start, end]共n块空间：先放transfer cache，放不下再还给span
+    void ReleaseRange(void *start, void *end, size_t n, size_t size);
+
+    // 汇总cc中每个桶的统计
+    void GetStats(MemoryPoolStats &stats);
+
+    // 把transfer cache中缓存的批还给span，span全部还回来后才能交给pc、还给系统
+    // idleOnly：只还上次调用以来一直没被用到的批，给后台scavenger用
+    // 返回还回去的字节数
+    size_t ReleaseTransferCaches(bool idleOnly);
 //
 private:
-    SpanList _spanlist[NLISTS];     // cc中挂载的spanlist
+    // 当前线程使用的分片：打开cpu cache时按CPU，否则按线程轮流分配
+    static size_t HomeShard();
+
+    CentralShard _shards[NLISTS][CENTRAL_SHARDS];  // cc中每个桶的分片
+    TransferCache _transfer[NLISTS]; // 每个桶整批缓存的内存块
 
 // 确保唯实例是'_inst'
 private:
     // 构造函数私有，防止外部代码创建实例
-    CentralCache() {}
+    constexpr CentralCache() {}
     // 饿汉创建一个CentralCache对象
     static CentralCache _inst;
 
@@ -1,35 +1,254 @@
 #include "ConcurrentAlloc.h"
+#include <condition_variable>
+#include <string.h>
+
+// 所有线程的tc都从这个对象池中申请
+static ObjectPool<ThreadCache> tcPool;
+
+// 静态TLS：只在本文件中访问，放在头文件里每个编译单元都会有一份自己的副本
+// _declspec (thread)是windows方法
+// static _declspec(thread) ThreadCache* pTLSThreadCache = nullptr; // ==> _declspec(thread)是Windows特有的，不是所有编译器都支持
+// _declspec (thread) static ThreadCache* tlslist = nullptr;
+static thread_local ThreadCache* pTLSThreadCache = nullptr;      // thread_local是C++11提供的，能跨平台
+
+// 本线程的tc是否已经在线程退出时回收
+// 线程退出过程中（其他thread_local析构、glibc回收TLS）还可能申请释放内存，这时不能再创建tc
+static thread_local bool tlsCacheReleased = false;
+
+// 线程退出时析构：把tc中缓存的对象还给cc，tc对象还给对象池
+struct ThreadCacheReleaser {
+    ~ThreadCacheReleaser() {
+        if (pTLSThreadCache == nullptr) {
+            return;
+        }
+        ThreadCache* tc = pTLSThreadCache;
+        pTLSThreadCache = nullptr;
+        tlsCacheReleased = true;
+
+        tcPool.Lock();
+        tcPool.Delete(tc);     // 调用~ThreadCache，把对象还给cc
+        tcPool.UnLock();
+    }
+};
+static thread_local ThreadCacheReleaser tlsReleaser;
+
+// 获取当前线程的tc，没有就创建
+static ThreadCache* GetThreadCache() {
+    if (pTLSThreadCache == nullptr) {
+        tcPool.Lock();
+//            pTLSThreadCache = new ThreadCache;
+        pTLSThreadCache = tcPool.New();
+        tcPool.UnLock();
+        // 访问一次thread_local对象，让它在本线程构造，线程退出时才会析构
+        (void) &tlsReleaser;
+    }
+    return pTLSThreadCache;
+}
+
+// 小块内存的申请：cpu cache / tc / 线程已退出时直接找cc
+static void* AllocSmall(size_t size) {
+    // 启用了cpu cache时，按当前CPU缓存
+    if (CpuCache::Enabled()) {
+        return CpuCache::GetInstance()->Allocate(size);
+    }
+    if (tlsCacheReleased) {
+        void* start = nullptr;
+        void* end = nullptr;
+        size_t classSize = SizeClass::RoundUp(size);
+        size_t n = CentralCache::GetInstance()->FetchRangeObj(start, end, 1, classSize);
+        // transfer cache可能整批给出多个，只留第一个，其余的还给span
+        if (n > 1) {
+            NEXT_OBJ(end) = nullptr;
+            CentralCache::GetInstance()->ReleaseListToSpans(NEXT_OBJ(start), classSize);
+        }
+        return start;
+    }
+    // 因为TLS，所以不存在竞争问题
+    // 此时，每个线程都有了一个ThreadCache对象
+    return GetThreadCache()->Allocate(size);
+}
+
+// 小块内存的释放
+static void FreeSmall(void* obj, size_t size) {
+    if (CpuCache::Enabled()) {
+        CpuCache::GetInstance()->Deallocate(obj, size);
+    } else if (tlsCacheReleased) {
+        NEXT_OBJ(obj) = nullptr;
+        CentralCache::GetInstance()->ReleaseListToSpans(obj, size);
+    } else {
+        GetThreadCache()->Deallocate(obj, size);
+    }
+}
+
+// 大块内存直接从pc拿span，zeroed不为空时返回这块内存是否已经全为0
+static void* AllocLarge(size_t size, bool* zeroed = nullptr) {
+    size_t pageNum = (SizeClass::RoundUp(size)) >> PAGE_SHIFT;
+
+    PageCache::GetInstance()->Lock();
+    Span* span = PageCache::GetInstance()->NewSpan(pageNum);
+    span->_objsize = size;
+    if (zeroed) {
+        *zeroed = span->_zeroed;
+    }
+    span->_zeroed = false;      // 交给应用程序之后就不再是全0了
+    PageCache::GetInstance()->UnLock();
+
+    return (void*)(span->_pageid << PAGE_SHIFT);
+}
+
+// 堆分析采样：申请出去之前调用
+static inline void* Sampled(void* ptr, size_t size) {
+    if (HeapProfiler::ShouldSample(size)) {
+        HeapProfiler::RecordAlloc(ptr, size);
+    }
+    return ptr;
+}
 
 void* ConcurrentAlloc(size_t size) {
     // cout << std::this_thread::get_id() << " " << pTLSThreadCache << endl;
+#ifdef MEMPOOL_CHECKED
+    // 检查模式：尾部多申请canary的空间
+    size_t total = size + MemoryChecker::CANARY_BYTES;
+    void* ptr = total > MAX_BYTES ? AllocLarge(total) : AllocSmall(total);
+    return Sampled(MemoryChecker::OnAlloc(ptr, size), size);
+#else
     if (size > MAX_BYTES) {
         // 直接向os申请
-        size_t pageNum = (SizeClass::RoundUp(size)) >> PAGE_SHIFT;
+        return Sampled(AllocLarge(size), size);
+    } else {
+        return Sampled(AllocSmall(size), size);
+    }
+#endif
+}
 
-        PageCache::GetInstance()->Lock();
-        Span* span = PageCache::GetInstance()->NewSpan(pageNum);
-        span->_objsize = size;
-        PageCache::GetInstance()->UnLock();
+void* ConcurrentCalloc(size_t n, size_t size) {
+    size_t total = 0;
+    if (__builtin_mul_overflow(n, size, &total)) {
+        throw std::bad_alloc();
+    }
+#ifdef MEMPOOL_CHECKED
+    // 检查模式：不区分内存是否已经是0，统一memset
+    void* checked = ConcurrentAlloc(total);
+    memset(checked, 0, total);
+    return checked;
+#else
+    if (total > MAX_BYTES) {
+        bool zeroed = false;
+        void* ptr = AllocLarge(total, &zeroed);
+        if (!zeroed) {
+            memset(ptr, 0, total);
+        }
+        return Sampled(ptr, total);
+    }
+    // 小块内存都是从自由链表上拿的，至少第一个指针被写过
+    void* ptr = AllocSmall(total);
+    memset(ptr, 0, total);
+    return Sampled(ptr, total);
+#endif
+}
 
-        void* ptr = (void*)(span->_pageid << PAGE_SHIFT);
-        return ptr;
-    } else {
-        // 直接new，因为TLS，所以不存在竞争问题
-        if (pTLSThreadCache == nullptr) {
-            static ObjectPool<ThreadCache> objPool;
-            objPool.Lock();
-//            pTLSThreadCache = new ThreadCache;
-            pTLSThreadCache = objPool.New();
-            objPool.UnLock();
+// 按align对齐申请，不采样
+static void* AllocAligned(size_t size, size_t align) {
+
+    // span的起始地址按页对齐，span切出的内存块首尾相接，内存块大小是align的倍数时起始地址就按align对齐
+    // 所以不超过一页的对齐，只要找到一个大小是align倍数的桶即可
+    if (align <= ((size_t) 1 << PAGE_SHIFT)) {
+        size_t n = (size + align - 1) & ~(align - 1);
+        while (n <= MAX_BYTES && SizeClass::RoundUp(n) % align != 0) {
+            n = (SizeClass::RoundUp(n) + align) & ~(align - 1);
         }
-        // 此时，每个线程都有了一个ThreadCache对象
+        if (n <= MAX_BYTES) {
+            return AllocSmall(n);
+        }
+        if (size > MAX_BYTES) {
+            // 大块内存本来就按页对齐
+            return AllocLarge(size);
+        }
+    }
 
-        return pTLSThreadCache->Allocate(size);
+    // 超过一页的对齐：从pc拿一个首页按align对齐的span
+    size_t pageNum = (size + ((size_t) 1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+    size_t alignPages = align > ((size_t) 1 << PAGE_SHIFT) ? align >> PAGE_SHIFT : 1;
+
+    PageCache::GetInstance()->Lock();
+    Span* span = PageCache::GetInstance()->NewAlignedSpan(pageNum, alignPages);
+    // _objsize > MAX_BYTES表示整个span是一块内存，ConcurrentFree时整块还给pc
+    span->_objsize = size > MAX_BYTES ? size : MAX_BYTES + 1;
+    span->_zeroed = false;
+    PageCache::GetInstance()->UnLock();
+
+    return (void*)(span->_pageid << PAGE_SHIFT);
+}
+
+void* ConcurrentAllocAligned(size_t size, size_t align) {
+    assert (align > 0 && (align & (align - 1)) == 0);
+    if (align <= 8) {
+        return ConcurrentAlloc(size);
     }
+#ifdef MEMPOOL_CHECKED
+    void* ptr = AllocAligned(size + MemoryChecker::CANARY_BYTES, align);
+    return Sampled(MemoryChecker::OnAlloc(ptr, size), size);
+#else
+    return Sampled(AllocAligned(size, align), size);
+#endif
 }
 
-void* ConcurrentFree(void* obj) {
-    assert (obj);
+void* ConcurrentRealloc(void* obj, size_t size) {
+    if (obj == nullptr) {
+        return ConcurrentAlloc(size);
+    }
+    if (size == 0) {
+        ConcurrentFree(obj);
+        return nullptr;
+    }
+
+#ifdef MEMPOOL_CHECKED
+    // 检查模式：不原地调整，每次都换一块新的，旧的按普通的回收检查
+    size_t oldSize = MemoryChecker::UsableSize(obj);
+    void* moved = ConcurrentAlloc(size);
+    memcpy(moved, obj, size < oldSize ? size : oldSize);
+    ConcurrentFree(obj);
+    return moved;
+#else
+    Span* span = PageCache::GetInstance()->MapObjectToSpan(obj);
+    size_t capacity = 0;
+    if (span->_objsize <= MAX_BYTES) {
+        // 小块内存：桶的大小就是可用的大小；只有新的size还落在同一个桶时才原地返回，
+        // 否则换桶，保证之后按新的size带大小回收时找到的还是这个桶
+        capacity = span->_objsize;
+        if (size <= MAX_BYTES && SizeClass::Index(size) == SizeClass::Index(capacity)) {
+            return obj;
+        }
+    } else {
+        // 大块内存：整个span都可用（对齐申请的span首地址就是obj）
+        capacity = (span->_npage << PAGE_SHIFT) - ((char*) obj - (char*) (span->_pageid << PAGE_SHIFT));
+        if (size <= capacity && size > MAX_BYTES) {
+            span->_objsize = size;
+            return obj;
+        }
+        if (size > capacity && size > MAX_BYTES && (char*) obj == (char*) (span->_pageid << PAGE_SHIFT)) {
+            size_t pageNum = (size + ((size_t) 1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+            PageCache::GetInstance()->Lock();
+            bool grown = PageCache::GetInstance()->GrowSpan(span, pageNum);
+            if (grown) {
+                span->_objsize = size;
+            }
+            PageCache::GetInstance()->UnLock();
+            if (grown) {
+                return obj;
+            }
+        }
+    }
+
+    void* ptr = ConcurrentAlloc(size);
+    memcpy(ptr, obj, size < capacity ? size : capacity);
+    ConcurrentFree(obj);
+    return ptr;
+#endif
+}
+
+// 通过span找到内存块的大小回收
+static void FreeBySpan(void* obj) {
     Span* span = PageCache::GetInstance()->MapObjectToSpan(obj);
     size_t size = span->_objsize;
     if (size > MAX_BYTES) {
@@ -37,7 +256,115 @@ void* ConcurrentFree(void* obj) {
         PageCache::GetInstance()->ReleaseSpanToPageCache(span);
         PageCache::GetInstance()->UnLock();
     } else {
-        pTLSThreadCache->Deallocate(obj, size);
+        FreeSmall(obj, size);
+    }
+}
+
+void ConcurrentFree(void* obj) {
+    assert (obj);
+    HeapProfiler::RecordFree(obj);
+#ifdef MEMPOOL_CHECKED
+    MemoryChecker::OnFree(obj);
+#endif
+    FreeBySpan(obj);
+}
+
+void ConcurrentFree(void* obj, size_t size) {
+    assert (obj);
+#ifdef MEMPOOL_CHECKED
+    // 检查模式：每块内存都多了canary，不能按size找桶；核对size后通过span回收
+    HeapProfiler::RecordFree(obj);
+    MemoryChecker::OnFree(obj, size);
+    FreeBySpan(obj);
+#else
+    if (size > MAX_BYTES) {
+        // 大块内存还是要通过span还给pc
+        HeapProfiler::RecordFree(obj);
+        FreeBySpan(obj);
+    } else {
+        // 小块内存直接按size找到tc的桶，不查span，不碰pc
+        HeapProfiler::RecordFree(obj);
+        FreeSmall(obj, size);
     }
+#endif
+}
 
-}
\ No newline at end of file
+MemoryPoolStats GetStats() {
+    MemoryPoolStats stats;
+    // 先统计tc，cc计算应用程序手里的内存块数时要用到
+    ThreadCache::GetStats(stats);
+    CentralCache::GetInstance()->GetStats(stats);
+    PageCache::GetInstance()->GetStats(stats._pageCache);
+    return stats;
+}
+
+void SetThreadCacheBudget(size_t bytes) {
+    ThreadCache::SetOverallBudget(bytes);
+}
+
+void SetCpuCacheEnabled(bool enabled) {
+    CpuCache::SetEnabled(enabled);
+}
+
+size_t ReleaseFreeMemory() {
+    // 先把transfer cache里的内存块还给span，这些span才可能整个空出来
+    CentralCache::GetInstance()->ReleaseTransferCaches(false);
+    PageCache::GetInstance()->Lock();
+    size_t pages = PageCache::GetInstance()->ReleaseIdlePages(0, 0);
+    PageCache::GetInstance()->UnLock();
+    return pages << PAGE_SHIFT;
+}
+
+// 后台scavenger线程的状态
+static std::mutex scavengerMtx;
+static std::condition_variable scavengerCond;
+static std::thread scavengerThread;
+static bool scavengerStop = false;
+static size_t scavengerInterval = 1000;
+static size_t scavengerIdle = 10000;
+static size_t scavengerBudget = 0;
+
+static void ScavengerLoop() {
+    std::unique_lock<std::mutex> lock(scavengerMtx);
+    while (!scavengerStop) {
+        scavengerCond.wait_for(lock, std::chrono::milliseconds(scavengerInterval));
+        if (scavengerStop) {
+            break;
+        }
+        CentralCache::GetInstance()->ReleaseTransferCaches(true);
+        PageCache::GetInstance()->Lock();
+        PageCache::GetInstance()->ReleaseIdlePages(scavengerIdle, scavengerBudget);
+        PageCache::GetInstance()->UnLock();
+    }
+}
+
+void StartBackgroundScavenger(size_t intervalMs, size_t idleMs, size_t budgetPages) {
+    std::unique_lock<std::mutex> lock(scavengerMtx);
+    scavengerInterval = intervalMs > 0 ? intervalMs : 1;
+    scavengerIdle = idleMs;
+    scavengerBudget = budgetPages;
+    if (scavengerThread.joinable()) {
+        return;
+    }
+    scavengerStop = false;
+    scavengerThread = std::thread(ScavengerLoop);
+
+    // 进程退出时线程还在运行，std::thread析构会terminate，退出前先停掉
+    static bool registered = false;
+    if (!registered) {
+        registered = true;
+        atexit(StopBackgroundScavenger);
+    }
+}
+
+void StopBackgroundScavenger() {
+    {
+        std::unique_lock<std::mutex> lock(scavengerMtx);
+        if (!scavengerThread.joinable()) {
+            return;
+        }
+        scavengerStop = true;
+    }
+    scavengerCond.notify_all();
+    scavengerThread.join();
+}
@@ -2,13 +2,55 @@
 #define MEMORY_POOL_CONCURRENTALLOC_H
 
 #include "ThreadCache.h"
+#include "CpuCache.h"
 #include "PageCache.h"
+#include "CentralCache.h"
 #include "ObjectPool.h"
+#include "HeapProfiler.h"
+#include "MemoryChecker.h"
 
 // 线程调用这个函数申请空间
 void* ConcurrentAlloc(size_t size);
 
+// 申请n * size字节全为0的空间，相乘溢出时抛bad_alloc
+// 大块内存刚向系统申请或已经还给过系统时本来就是0，不再memset
+void* ConcurrentCalloc(size_t n, size_t size);
+
+// 按align字节对齐申请空间，align必须是2的幂
+// 能找到大小是align倍数的桶时走小块内存，否则按页对齐从pc拿span；只能用ConcurrentFree(obj)回收
+void* ConcurrentAllocAligned(size_t size, size_t align);
+
+// 调整obj的大小：小块内存新的size还在同一个桶时原地返回obj，返回值可以按新的size带大小回收；
+// 大块内存新的size还放得下时原地返回，否则优先并入右边相邻的空闲页原地扩大
+// 都不行时申请新的空间，拷贝后回收obj。obj为nullptr时等价于ConcurrentAlloc，size为0时回收obj并返回nullptr
+void* ConcurrentRealloc(void* obj, size_t size);
+
 // 回收空间
-void* ConcurrentFree(void* obj);
+void ConcurrentFree(void* obj);
+
+// 带大小的回收：调用方知道申请时的size（如C++14的sized delete），小块内存不需要再通过span查size
+void ConcurrentFree(void* obj, size_t size);
+
+// 获取内存池各层的统计：tc / transfer cache / cc / pc 中各缓存了多少，应用程序手里有多少
+MemoryPoolStats GetStats();
+
+// 设置所有线程的tc一共最多缓存的字节数（默认32M，也可以通过环境变量 MEMPOOL_TC_BUDGET 设置）
+// 一个线程的tc满了时从其他线程的tc那里偷上限，线程很多时总的缓存量也不会超过预算太多
+void SetThreadCacheBudget(size_t bytes);
+
+// 打开或关闭按CPU缓存（默认关闭，也可以通过环境变量 MEMPOOL_PERCPU=1 打开），见CpuCache.h
+void SetCpuCacheEnabled(bool enabled);
+
+// 先把cc的transfer cache中缓存的内存块全部还给span，
+// 再立即把pc中所有空闲页的物理内存还给系统，返回还回去的字节数
+size_t ReleaseFreeMemory();
+
+// 启动后台scavenger线程：每intervalMs毫秒检查一次，把空闲超过idleMs毫秒的页还给系统
+// 每次检查时也把transfer cache中上次检查以来一直没被取走的批还给span
+// 每次最多还budgetPages页（0表示不限），避免一次持有pc锁太久；重复调用只会更新参数
+void StartBackgroundScavenger(size_t intervalMs = 1000, size_t idleMs = 10000, size_t budgetPages = 0);
+
+// 停止后台scavenger线程
+void StopBackgroundScavenger();
 
 #endif //MEMORY_POOL_CONCURRENTALLOC_H
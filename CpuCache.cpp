@@ -0,0 +1,90 @@
+#include "CpuCache.h"
+
+#include <sched.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define MEMPOOL_HAVE_RSEQ 1
+#endif
+#endif
+
+// 单例
+CpuCache CpuCache::_inst;
+std::atomic<int> CpuCache::_enabled{-1};
+
+bool
+CpuCache::Enabled() {
+    int enabled = _enabled.load(std::memory_order_relaxed);
+    if (enabled < 0) {
+        enabled = EnvEnabled("MEMPOOL_PERCPU") ? 1 : 0;
+        // 已经被SetEnabled设置过时不覆盖
+        int expected = -1;
+        if (!_enabled.compare_exchange_strong(expected, enabled, std::memory_order_relaxed)) {
+            enabled = expected;
+        }
+    }
+    return enabled != 0;
+}
+
+void
+CpuCache::SetEnabled(bool enabled) {
+    _enabled.store(enabled ? 1 : 0, std::memory_order_relaxed);
+}
+
+// 获取当前CPU编号
+// glibc 2.35之后会为每个线程注册rseq，内核在线程切换CPU时更新rseq中的cpu_id，直接读TLS即可
+// 没有rseq时退化为sched_getcpu（vdso调用）
+size_t
+CpuCache::CurrentCpu() {
+#ifdef MEMPOOL_HAVE_RSEQ
+    if (__rseq_size > 0) {
+        const struct rseq *rs = (const struct rseq *) ((char *) __builtin_thread_pointer() + __rseq_offset);
+        int32_t cpu = (int32_t) rs->cpu_id;
+        if (cpu >= 0) {
+            return (size_t) cpu;
+        }
+    }
+#endif
+    int cpu = sched_getcpu();
+    return cpu < 0 ? 0 : (size_t) cpu;
+}
+
+CpuCache::Slot *
+CpuCache::GetSlot() {
+    Slot *slots = _slots.load(std::memory_order_acquire);
+    if (slots == nullptr) {
+        std::unique_lock<std::mutex> lock(_initMtx);
+        slots = _slots.load(std::memory_order_relaxed);
+        if (slots == nullptr) {
+            long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+            _nslot = ncpu > 0 ? (size_t) ncpu : 1;
+            // slot数组直接向系统申请，不经过malloc
+            size_t bytes = _nslot * sizeof(Slot);
+            slots = (Slot *) SystemAlloc((bytes + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT);
+            for (size_t i = 0; i < _nslot; ++i) {
+                new(&slots[i]) Slot;
+            }
+            _slots.store(slots, std::memory_order_release);
+        }
+    }
+    // 热插拔等情况下CPU编号可能超过启动时的CPU数，取模兜底
+    return &slots[CurrentCpu() % _nslot];
+}
+
+void *
+CpuCache::Allocate(size_t size) {
+    Slot *slot = GetSlot();
+    slot->Lock();
+    void *ptr = slot->_cache.Allocate(size);
+    slot->Unlock();
+    return ptr;
+}
+
+void
+CpuCache::Deallocate(void *ptr, size_t size) {
+    Slot *slot = GetSlot();
+    slot->Lock();
+    slot->_cache.Deallocate(ptr, size);
+    slot->Unlock();
+}
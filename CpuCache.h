@@ -0,0 +1,65 @@
+#ifndef MEMORY_POOL_CPUCACHE_H
+#define MEMORY_POOL_CPUCACHE_H
+
+#include <atomic>
+#include "ThreadCache.h"
+
+// CPU Cache：按当前运行的CPU而不是按线程缓存内存块
+// 线程数远多于核数时，tc的总占用随线程数增长，cpu cache只随核数增长
+// 默认关闭，设置环境变量 MEMPOOL_PERCPU=1 或调用SetCpuCacheEnabled后ConcurrentAlloc/ConcurrentFree的小块内存走这里
+
+// 单例，饿汉
+class CpuCache {
+public:
+    static CpuCache *GetInstance() {
+        return &_inst;
+    }
+
+    // 是否启用cpu cache，进程内第一次调用时读取环境变量
+    static bool Enabled();
+
+    // 运行中打开或关闭cpu cache
+    // 切换前后申请的内存块可以混着释放：tc和cpu cache都只是按桶缓存内存块，已经缓存的留在原处
+    static void SetEnabled(bool enabled);
+
+    //申请和释放size大小对象
+    void *Allocate(size_t size);
+    void Deallocate(void *ptr, size_t size);
+
+    // 当前线程所在的CPU
+    static size_t CurrentCpu();
+
+private:
+    // 每个CPU一个tc，加一把自旋锁
+    // 同一个CPU上同一时刻只会跑一个线程，只有线程在临界区被抢占或迁移时锁才会竞争
+    struct alignas(64) Slot {
+        std::atomic_flag _lock = ATOMIC_FLAG_INIT;
+        ThreadCache _cache;
+
+        void Lock() {
+            while (_lock.test_and_set(std::memory_order_acquire)) {
+                std::this_thread::yield();
+            }
+        }
+
+        void Unlock() {
+            _lock.clear(std::memory_order_release);
+        }
+    };
+
+    // 找到当前CPU的slot，第一次调用时创建所有slot
+    Slot *GetSlot();
+
+    static std::atomic<int> _enabled;   // -1：还没读环境变量
+
+    std::atomic<Slot *> _slots{nullptr};
+    size_t _nslot = 0;
+    std::mutex _initMtx;
+
+    constexpr CpuCache() {}
+    CpuCache(const CpuCache &) = delete;
+    CpuCache &operator=(const CpuCache &) = delete;
+    static CpuCache _inst;
+};
+
+#endif //MEMORY_POOL_CPUCACHE_H
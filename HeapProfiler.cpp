@@ -0,0 +1,375 @@
+#include "HeapProfiler.h"
+#include <cmath>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+std::atomic<uint8_t> HeapProfiler::_filter[HeapProfiler::FILTER_SIZE];
+std::atomic<size_t> HeapProfiler::_liveSamples{0};
+
+// 关闭采样时，每申请这么多字节检查一次是否被打开
+static const ptrdiff_t DISABLED_CHECK_BYTES = 1 << 20;
+static const int MAX_DEPTH = 32;
+
+// 一次采样的记录
+struct Sample {
+    void *_ptr = nullptr;        // 为nullptr表示导出期间已经被释放，等导出结束再删
+    size_t _size = 0;
+    size_t _rate = 0;            // 采样时的平均间隔，导出时用来估算真实的字节数
+    int _depth = 0;
+    void *_stack[MAX_DEPTH] = {};
+    Sample *_next = nullptr;     // 哈希桶中的下一个
+};
+
+// 采样记录的哈希表，节点从ObjectPool申请，不经过内存池本身
+static const size_t SAMPLE_BUCKETS = 4096;
+static Sample *sampleBuckets[SAMPLE_BUCKETS];
+static ObjectPool<Sample> samplePool;
+static std::mutex sampleMtx;
+
+static std::atomic<size_t> sampleRate{0};
+
+// 采样过程中（取调用栈可能申请内存）本线程的申请不再采样
+static thread_local bool tlsInProfiler = false;
+// 导出时本线程持有sampleMtx，本线程的释放不能再去加锁
+static thread_local bool tlsDumping = false;
+static thread_local uint64_t tlsRandom = 0;
+// 本线程栈的最高地址，0表示还没取，1表示取不到
+static thread_local uintptr_t tlsStackHi = 0;
+
+static size_t SampleBucket(void *ptr) {
+    return ((size_t) ptr >> 4) % SAMPLE_BUCKETS;
+}
+
+static size_t GetSampleRate() {
+    // 第一次调用时读取环境变量
+    static bool envRead = [] {
+        const char *env = getenv("MEMPOOL_PROFILE_RATE");
+        if (env != nullptr && env[0] != '\0') {
+            char *end = nullptr;
+            size_t rate = strtoull(env, &end, 10);
+            if (end == env) {
+                rate = HeapProfiler::DEFAULT_SAMPLE_RATE;
+            }
+            sampleRate.store(rate, std::memory_order_relaxed);
+        }
+        return true;
+    }();
+    (void) envRead;
+    return sampleRate.load(std::memory_order_relaxed);
+}
+
+// 下一次采样的间隔：均值为rate的指数分布，避免和程序的申请模式同步
+static ptrdiff_t NextSampleInterval(size_t rate) {
+    if (tlsRandom == 0) {
+        tlsRandom = (uint64_t) &tlsRandom ^ (uint64_t) NowMs() ^ 0x9E3779B97F4A7C15ull;
+    }
+    // xorshift64
+    tlsRandom ^= tlsRandom << 13;
+    tlsRandom ^= tlsRandom >> 7;
+    tlsRandom ^= tlsRandom << 17;
+    double u = (double) (tlsRandom >> 11) / (double) (1ull << 53);
+    double interval = -log(1.0 - u) * (double) rate;
+    return interval < 1 ? 1 : (ptrdiff_t) interval;
+}
+
+static uintptr_t StackHi() {
+    if (tlsStackHi == 0) {
+        tlsStackHi = 1;
+        // 主线程第一次调用时glibc会读/proc/self/maps并申请内存，调用方已经设置了tlsInProfiler
+        pthread_attr_t attr;
+        if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+            void *addr = nullptr;
+            size_t size = 0;
+            if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+                tlsStackHi = (uintptr_t) addr + size;
+            }
+            pthread_attr_destroy(&attr);
+        }
+    }
+    return tlsStackHi;
+}
+
+// 沿帧指针链取调用栈，第一层是调用者中的返回地址
+// glibc的backtrace每次要查.eh_frame展开，一次采样要几微秒；帧指针链每层只读两个字，几十纳秒就够了
+// 每一帧开头是[上一帧的帧指针, 返回地址]，需要代码用-fno-omit-frame-pointer编译（CMakeLists.txt中已打开）
+// 遇到不带帧指针的代码时读到的可能是别的值：不在本线程的栈上、不是往栈底走或者没有对齐时就停下
+// 连内存池外面的第一层调用者都没走出去（应用程序没有帧指针）、取不到栈的范围或者不是x86-64/ARM64时退回backtrace
+// 读到的可能是栈上别的函数的局部变量，ASan会当成越界，这里不做检查
+__attribute__((noinline, no_sanitize_address)) static int FrameBacktrace(void **stack, int maxDepth) {
+#if defined(__x86_64__) || defined(__aarch64__)
+    uintptr_t hi = StackHi();
+    if (hi != 1) {
+        uintptr_t fp = (uintptr_t) __builtin_frame_address(0);
+        int depth = 0;
+        while (depth < maxDepth && fp % sizeof(void *) == 0 && fp + 2 * sizeof(void *) <= hi) {
+            void **frame = (void **) fp;
+            if (frame[1] == nullptr) {
+                break;
+            }
+            stack[depth++] = frame[1];
+            uintptr_t next = (uintptr_t) frame[0];
+            if (next <= fp) {
+                break;
+            }
+            fp = next;
+        }
+        // RecordAlloc、ConcurrentAlloc、应用程序中的调用者各一层，再往上还能走才说明帧指针链是完整的
+        if (depth > 3) {
+            return depth;
+        }
+    }
+#endif
+    return backtrace(stack, maxDepth);
+}
+
+void
+HeapProfiler::SetSampleRate(size_t bytes) {
+    GetSampleRate();
+    sampleRate.store(bytes, std::memory_order_relaxed);
+}
+
+void
+HeapProfiler::RecordAlloc(void *ptr, size_t size) {
+    size_t rate = GetSampleRate();
+    if (rate == 0) {
+        _bytesUntilSample = DISABLED_CHECK_BYTES;
+        return;
+    }
+    _bytesUntilSample = NextSampleInterval(rate);
+    if (tlsInProfiler) {
+        return;
+    }
+    tlsInProfiler = true;
+
+    // 取调用栈在加锁之前，第一次取栈的范围或调用backtrace时glibc会申请内存
+    void *stack[MAX_DEPTH + 1];
+    int depth = FrameBacktrace(stack, MAX_DEPTH + 1);
+
+    {
+        std::unique_lock<std::mutex> lock(sampleMtx);
+        Sample *sample = samplePool.New();
+        sample->_ptr = ptr;
+        sample->_size = size;
+        sample->_rate = rate;
+        // 跳过RecordAlloc自己这一层
+        sample->_depth = depth > 1 ? depth - 1 : 0;
+        for (int i = 0; i < sample->_depth; ++i) {
+            sample->_stack[i] = stack[i + 1];
+        }
+        size_t bucket = SampleBucket(ptr);
+        sample->_next = sampleBuckets[bucket];
+        sampleBuckets[bucket] = sample;
+
+        std::atomic<uint8_t> &counter = _filter[FilterIndex(ptr)];
+        uint8_t count = counter.load(std::memory_order_relaxed);
+        // 计数饱和后不再增减，这个位置以后总要查表
+        if (count < 255) {
+            counter.store(count + 1, std::memory_order_relaxed);
+        }
+        _liveSamples.fetch_add(1, std::memory_order_relaxed);
+    }
+    tlsInProfiler = false;
+}
+
+void
+HeapProfiler::RecordFreeSlow(void *ptr) {
+    // 导出时本线程（dladdr等）释放内存：已经持有锁，不再加锁
+    std::unique_lock<std::mutex> lock(sampleMtx, std::defer_lock);
+    if (!tlsDumping) {
+        lock.lock();
+    }
+    Sample **link = &sampleBuckets[SampleBucket(ptr)];
+    while (*link && (*link)->_ptr != ptr) {
+        link = &(*link)->_next;
+    }
+    // 计数过滤器的误判：ptr没有被采样
+    if (*link == nullptr) {
+        return;
+    }
+    Sample *sample = *link;
+    if (tlsDumping) {
+        // Dump可能正在遍历这个采样，先标记为已释放，Dump结束前再删
+        sample->_ptr = nullptr;
+    } else {
+        *link = sample->_next;
+        samplePool.Delete(sample);
+    }
+
+    std::atomic<uint8_t> &counter = _filter[FilterIndex(ptr)];
+    uint8_t count = counter.load(std::memory_order_relaxed);
+    if (count < 255) {
+        counter.store(count - 1, std::memory_order_relaxed);
+    }
+    _liveSamples.fetch_sub(1, std::memory_order_relaxed);
+}
+
+// 删掉导出期间被释放的采样，持有sampleMtx时调用
+static void RemoveFreedSamples() {
+    for (size_t i = 0; i < SAMPLE_BUCKETS; ++i) {
+        Sample **link = &sampleBuckets[i];
+        while (*link) {
+            Sample *sample = *link;
+            if (sample->_ptr == nullptr) {
+                *link = sample->_next;
+                samplePool.Delete(sample);
+            } else {
+                link = &sample->_next;
+            }
+        }
+    }
+}
+
+// 写文件用的小缓冲区，满了才write，不申请内存
+struct DumpWriter {
+    int _fd;
+    char _buf[4096];
+    size_t _len = 0;
+    bool _ok = true;
+
+    explicit DumpWriter(int fd) : _fd(fd) {}
+
+    void Flush() {
+        size_t off = 0;
+        while (_ok && off < _len) {
+            ssize_t n = write(_fd, _buf + off, _len - off);
+            if (n <= 0) {
+                _ok = false;
+            } else {
+                off += n;
+            }
+        }
+        _len = 0;
+    }
+
+    void Append(const char *data, size_t len) {
+        while (len > 0) {
+            if (_len == sizeof(_buf)) {
+                Flush();
+            }
+            size_t n = min(len, sizeof(_buf) - _len);
+            memcpy(_buf + _len, data, n);
+            _len += n;
+            data += n;
+            len -= n;
+        }
+    }
+
+    void Printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+        char line[512];
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(line, sizeof(line), fmt, args);
+        va_end(args);
+        if (n > 0) {
+            Append(line, min((size_t) n, sizeof(line) - 1));
+        }
+    }
+};
+
+// 采样的对象代表的平均字节数：大小为size的对象被采样到的概率是1 - e^(-size/rate)
+static double SampleScale(const Sample *sample) {
+    double p = 1.0 - exp(-(double) sample->_size / (double) sample->_rate);
+    return p > 0 ? 1.0 / p : 1.0;
+}
+
+// 折叠栈中的一帧：能找到符号时输出符号名+偏移，否则输出模块名+偏移（可以用addr2line查），都找不到输出地址
+static void WriteFrame(DumpWriter &out, void *pc) {
+    Dl_info info = {};
+    bool found = dladdr(pc, &info) != 0;
+    if (found && info.dli_sname) {
+        out.Printf("%s+0x%zx", info.dli_sname, (size_t) pc - (size_t) info.dli_saddr);
+    } else if (found && info.dli_fname && info.dli_fname[0]) {
+        const char *name = strrchr(info.dli_fname, '/');
+        out.Printf("%s+0x%zx", name ? name + 1 : info.dli_fname, (size_t) pc - (size_t) info.dli_fbase);
+    } else {
+        out.Printf("%p", pc);
+    }
+}
+
+bool
+HeapProfiler::Dump(const char *path, DumpFormat format) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    DumpWriter out(fd);
+
+    {
+        // 持有锁期间本线程如果申请内存（如dladdr），不再采样，避免死锁
+        std::unique_lock<std::mutex> lock(sampleMtx);
+        bool inProfiler = tlsInProfiler;
+        tlsInProfiler = true;
+        tlsDumping = true;
+
+        if (format == PPROF) {
+            size_t count = 0;
+            size_t bytes = 0;
+            for (size_t i = 0; i < SAMPLE_BUCKETS; ++i) {
+                for (Sample *s = sampleBuckets[i]; s; s = s->_next) {
+                    if (s->_ptr == nullptr) {
+                        continue;
+                    }
+                    ++count;
+                    bytes += s->_size;
+                }
+            }
+            // pprof根据heap_v2后面的采样间隔自己估算真实的数量
+            out.Printf("heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                       count, bytes, count, bytes, GetSampleRate());
+            for (size_t i = 0; i < SAMPLE_BUCKETS; ++i) {
+                for (Sample *s = sampleBuckets[i]; s; s = s->_next) {
+                    if (s->_ptr == nullptr) {
+                        continue;
+                    }
+                    out.Printf("1: %zu [1: %zu] @", s->_size, s->_size);
+                    for (int d = 0; d < s->_depth; ++d) {
+                        out.Printf(" %p", s->_stack[d]);
+                    }
+                    out.Append("\n", 1);
+                }
+            }
+        } else {
+            for (size_t i = 0; i < SAMPLE_BUCKETS; ++i) {
+                for (Sample *s = sampleBuckets[i]; s; s = s->_next) {
+                    if (s->_ptr == nullptr) {
+                        continue;
+                    }
+                    // 折叠栈从栈底写到栈顶
+                    for (int d = s->_depth - 1; d >= 0; --d) {
+                        WriteFrame(out, s->_stack[d]);
+                        if (d > 0) {
+                            out.Append(";", 1);
+                        }
+                    }
+                    out.Printf(" %.0f\n", (double) s->_size * SampleScale(s));
+                }
+            }
+        }
+        RemoveFreedSamples();
+        tlsInProfiler = inProfiler;
+        tlsDumping = false;
+    }
+
+    // pprof需要内存映射才能把地址对应到符号
+    if (format == PPROF) {
+        out.Printf("\nMAPPED_LIBRARIES:\n");
+        int maps = open("/proc/self/maps", O_RDONLY);
+        if (maps >= 0) {
+            char buf[4096];
+            ssize_t n;
+            while ((n = read(maps, buf, sizeof(buf))) > 0) {
+                out.Append(buf, n);
+            }
+            close(maps);
+        }
+    }
+    out.Flush();
+    close(fd);
+    return out._ok;
+}
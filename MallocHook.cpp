@@ -0,0 +1,282 @@
+// 替换libc的malloc/free系列函数和全局operator new/delete，全部转到ConcurrentAlloc/ConcurrentFree
+// 编译成libmempool.so，通过 LD_PRELOAD=./libmempool.so ./your_program 在不改代码的情况下使用内存池
+
+#include <errno.h>
+#include <string.h>
+#include <new>
+#include "ConcurrentAlloc.h"
+
+// malloc需要保证返回的内存满足max_align_t（16字节）对齐
+// 128字节以下的桶是8字节对齐，所以把size补齐到16的倍数，这样内存块大小是16的倍数，起始地址也就16字节对齐
+static const size_t MALLOC_ALIGN = 16;
+
+static inline size_t MallocSize(size_t size) {
+    if (size == 0) {
+        size = 1;
+    }
+    return (size + MALLOC_ALIGN - 1) & ~(MALLOC_ALIGN - 1);
+}
+
+static inline bool IsPowerOfTwo(size_t x) {
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+// 不抛异常的申请，失败返回nullptr
+static void* TryAlloc(size_t size) {
+    // 补齐到16时会溢出的size，肯定也申请不到
+    if (size > ((size_t) -1 >> 1)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    try {
+        return ConcurrentAlloc(MallocSize(size));
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+// 按align对齐申请
+static void* TryAllocAligned(size_t align, size_t size) {
+    if (align <= MALLOC_ALIGN) {
+        return TryAlloc(size);
+    }
+    if (size > ((size_t) -1 >> 1) || align > ((size_t) -1 >> 1)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    try {
+        return ConcurrentAllocAligned(MallocSize(size), align);
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+// 内存块实际可用的大小
+static size_t UsableSize(void* ptr) {
+#ifdef MEMPOOL_CHECKED
+    // 检查模式：尾部是canary，只有申请的大小可用
+    return MemoryChecker::UsableSize(ptr);
+#else
+    Span* span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+    if (span->_objsize > MAX_BYTES) {
+        return (span->_npage << PAGE_SHIFT) - ((char*) ptr - (char*) (span->_pageid << PAGE_SHIFT));
+    }
+    return span->_objsize;
+#endif
+}
+
+extern "C" {
+
+void* malloc(size_t size) noexcept {
+    return TryAlloc(size);
+}
+
+void free(void* ptr) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
+
+void* calloc(size_t nmemb, size_t size) noexcept {
+    size_t total = 0;
+    if (__builtin_mul_overflow(nmemb, size, &total) || total > ((size_t) -1 >> 1)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    try {
+        return ConcurrentCalloc(MallocSize(total), 1);
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+void* realloc(void* ptr, size_t size) noexcept {
+    if (ptr == nullptr) {
+        return TryAlloc(size);
+    }
+    if (size == 0) {
+        ConcurrentFree(ptr);
+        return nullptr;
+    }
+    if (size > ((size_t) -1 >> 1)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    // 申请失败时ConcurrentRealloc还没有回收ptr，符合realloc失败时原内存不变的要求
+    try {
+        return ConcurrentRealloc(ptr, MallocSize(size));
+    } catch (const std::bad_alloc&) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+}
+
+int posix_memalign(void** memptr, size_t align, size_t size) noexcept {
+    if (!IsPowerOfTwo(align) || align % sizeof(void*) != 0) {
+        return EINVAL;
+    }
+    void* ptr = TryAllocAligned(align, size);
+    if (ptr == nullptr) {
+        return ENOMEM;
+    }
+    *memptr = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size) noexcept {
+    if (!IsPowerOfTwo(align)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return TryAllocAligned(align, size);
+}
+
+void* memalign(size_t align, size_t size) noexcept {
+    if (!IsPowerOfTwo(align)) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return TryAllocAligned(align, size);
+}
+
+void* valloc(size_t size) noexcept {
+    return TryAllocAligned(sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) noexcept {
+    size_t pagesize = sysconf(_SC_PAGESIZE);
+    return TryAllocAligned(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
+
+size_t malloc_usable_size(void* ptr) noexcept {
+    return ptr ? UsableSize(ptr) : 0;
+}
+
+}
+
+// operator new：失败抛bad_alloc
+void* operator new(size_t size) {
+    void* ptr = TryAlloc(size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    void* ptr = TryAlloc(size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return TryAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return TryAlloc(size);
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    void* ptr = TryAllocAligned((size_t) align, size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+    void* ptr = TryAllocAligned((size_t) align, size);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return TryAllocAligned((size_t) align, size);
+}
+
+void* operator new[](size_t size, std::align_val_t align, const std::nothrow_t&) noexcept {
+    return TryAllocAligned((size_t) align, size);
+}
+
+// operator delete
+void operator delete(void* ptr) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
+
+void operator delete[](void* ptr) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
+
+// sized delete：size和new时一样按16补齐，保证落在同一个桶
+void operator delete(void* ptr, size_t size) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr, MallocSize(size));
+    }
+}
+
+void operator delete[](void* ptr, size_t size) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr, MallocSize(size));
+    }
+}
+
+// 对齐申请的内存块可能不在size对应的桶里，不走sized free
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    if (ptr) {
+        ConcurrentFree(ptr);
+    }
+}
@@ -0,0 +1,170 @@
+#include "MemoryChecker.h"
+
+#ifdef MEMPOOL_CHECKED
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "PageCache.h"
+
+// 一个span最多切出的内存块数：8字节的桶一次申请1页
+static const size_t MAX_SPAN_OBJS = ((size_t) 1 << PAGE_SHIFT) / 8;
+
+// 每个span的位图，从ObjectPool申请，不经过内存池本身
+struct SpanBitmap {
+    std::atomic<uint64_t> _words[MAX_SPAN_OBJS / 64];
+};
+
+static ObjectPool<SpanBitmap> bitmapPool;
+
+static const uint64_t CANARY_MAGIC = 0x6d656d706f6f6c21ull;
+static const unsigned char CANARY_FILL = 0xAB;
+
+// 打印错误后abort，不申请内存
+[[noreturn]] static void Report(const char *what, void *ptr, size_t size) {
+    char buf[160];
+    int len = snprintf(buf, sizeof(buf), "mempool: %s: %p (size %zu)\n", what, ptr, size);
+    if (len > 0) {
+        ssize_t ret = write(STDERR_FILENO, buf, (size_t) len < sizeof(buf) ? (size_t) len : sizeof(buf) - 1);
+        (void) ret;
+    }
+    abort();
+}
+
+// ptr所在内存块的末尾：小块内存是桶的大小，大块内存是整个span
+static char *SlotEnd(Span *span, void *ptr) {
+    if (span->_objsize <= MAX_BYTES) {
+        return (char *) ptr + span->_objsize;
+    }
+    return (char *) ((span->_pageid + span->_npage) << PAGE_SHIFT);
+}
+
+// 找到ptr所在的span，检查ptr是一块正在使用的内存的起始地址；小块内存通过index返回它在span中的下标
+static Span *Locate(void *ptr, size_t &index) {
+    Span *span = PageCache::GetInstance()->LookupSpan(ptr);
+    if (span == nullptr || !span->_isUse) {
+        Report("free of unallocated pointer (double free?)", ptr, 0);
+    }
+    char *start = (char *) (span->_pageid << PAGE_SHIFT);
+    if (span->_objsize == 0) {
+        Report("pointer was not allocated by the pool", ptr, 0);
+    }
+    if (span->_objsize > MAX_BYTES) {
+        if ((char *) ptr != start) {
+            Report("pointer is not the start of an allocation", ptr, 0);
+        }
+        index = 0;
+        return span;
+    }
+    size_t offset = (char *) ptr - start;
+    if (offset % span->_objsize != 0 || span->_bitmap == nullptr) {
+        Report("pointer is not the start of an allocation", ptr, span->_objsize);
+    }
+    index = offset / span->_objsize;
+    return span;
+}
+
+// 检查canary，返回申请时的大小
+static size_t CheckCanary(Span *span, void *ptr) {
+    char *tail = SlotEnd(span, ptr) - MemoryChecker::CANARY_BYTES;
+    uint64_t word;
+    memcpy(&word, tail, sizeof(word));
+    size_t size = (size_t) (word ^ CANARY_MAGIC);
+    if (size > (size_t) (tail - (char *) ptr)) {
+        Report("heap buffer overflow (canary size word corrupted)", ptr, span->_objsize);
+    }
+    for (char *p = (char *) ptr + size; p < tail; ++p) {
+        if ((unsigned char) *p != CANARY_FILL) {
+            Report("heap buffer overflow (canary bytes corrupted)", ptr, size);
+        }
+    }
+    return size;
+}
+
+static bool IsAllocated(Span *span, size_t index) {
+    if (span->_objsize > MAX_BYTES) {
+        return true;     // 大块内存还回pc后_isUse为false，Locate已经检查过
+    }
+    return (span->_bitmap[index / 64].load(std::memory_order_acquire) >> (index % 64)) & 1;
+}
+
+void *
+MemoryChecker::OnAlloc(void *ptr, size_t size) {
+    Span *span = PageCache::GetInstance()->MapObjectToSpan(ptr);
+    if (span->_objsize <= MAX_BYTES) {
+        size_t index = ((char *) ptr - (char *) (span->_pageid << PAGE_SHIFT)) / span->_objsize;
+        uint64_t bit = (uint64_t) 1 << (index % 64);
+        if (span->_bitmap[index / 64].fetch_or(bit, std::memory_order_acq_rel) & bit) {
+            // 同一块内存被分配了两次：自由链表已经被破坏（通常是之前没检查到的重复释放或释放后写）
+            Report("allocating an object that is still in use (free list corrupted)", ptr, size);
+        }
+    }
+
+    char *tail = SlotEnd(span, ptr) - MemoryChecker::CANARY_BYTES;
+    assert (tail >= (char *) ptr + size);
+    memset((char *) ptr + size, CANARY_FILL, tail - ((char *) ptr + size));
+    uint64_t word = (uint64_t) size ^ CANARY_MAGIC;
+    memcpy(tail, &word, sizeof(word));
+    return ptr;
+}
+
+void
+MemoryChecker::OnFree(void *ptr) {
+    size_t index = 0;
+    Span *span = Locate(ptr, index);
+    if (!IsAllocated(span, index)) {
+        Report("double free", ptr, span->_objsize);
+    }
+    CheckCanary(span, ptr);
+    if (span->_objsize <= MAX_BYTES) {
+        uint64_t bit = (uint64_t) 1 << (index % 64);
+        // 两个线程同时释放同一块内存时，只有一个能清掉这一位
+        if (!(span->_bitmap[index / 64].fetch_and(~bit, std::memory_order_acq_rel) & bit)) {
+            Report("double free", ptr, span->_objsize);
+        }
+    }
+}
+
+void
+MemoryChecker::OnFree(void *ptr, size_t size) {
+    size_t actual = UsableSize(ptr);
+    if (actual != size) {
+        Report("sized free does not match the allocation size", ptr, actual);
+    }
+    OnFree(ptr);
+}
+
+size_t
+MemoryChecker::UsableSize(void *ptr) {
+    size_t index = 0;
+    Span *span = Locate(ptr, index);
+    if (!IsAllocated(span, index)) {
+        Report("use of freed pointer", ptr, span->_objsize);
+    }
+    return CheckCanary(span, ptr);
+}
+
+void
+MemoryChecker::OnSpanCarved(Span *span, size_t nobj) {
+    if (nobj > MAX_SPAN_OBJS) {
+        Report("span has too many objects for the bitmap", (void *) (span->_pageid << PAGE_SHIFT), nobj);
+    }
+    bitmapPool.Lock();
+    SpanBitmap *bitmap = bitmapPool.New();
+    bitmapPool.UnLock();
+    for (std::atomic<uint64_t> &word : bitmap->_words) {
+        word.store(0, std::memory_order_relaxed);
+    }
+    span->_bitmap = bitmap->_words;
+}
+
+void
+MemoryChecker::OnSpanReleased(Span *span) {
+    SpanBitmap *bitmap = (SpanBitmap *) span->_bitmap;
+    span->_bitmap = nullptr;
+    bitmapPool.Lock();
+    bitmapPool.Delete(bitmap);
+    bitmapPool.UnLock();
+}
+
+#endif
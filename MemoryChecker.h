@@ -0,0 +1,38 @@
+#ifndef MEMORY_POOL_MEMORYCHECKER_H
+#define MEMORY_POOL_MEMORYCHECKER_H
+
+#include "common.h"
+
+#ifdef MEMPOOL_CHECKED
+
+// 检查模式（编译时定义MEMPOOL_CHECKED，cmake -DMEMPOOL_CHECKED=ON）：
+// 1. 每个切给cc的span带一个位图，记录每个内存块是否在应用程序手里，释放时发现重复释放和野指针
+// 2. 每块内存尾部多申请CANARY_BYTES字节：最后8字节存申请的大小（异或魔数），中间的空隙填满固定的字节，
+//    释放时检查有没有越界写，带大小的释放检查size和申请时是否一致
+// 发现错误时向stderr打印出错的地址后abort；不定义MEMPOOL_CHECKED时这里的代码都不会编译进去
+class MemoryChecker {
+public:
+    static const size_t CANARY_BYTES = 8;
+
+    // 内存块已经拿到、交给应用程序之前调用，size是应用程序申请的大小
+    static void *OnAlloc(void *ptr, size_t size);
+
+    // 回收之前调用：检查ptr是正在使用的内存块且canary完好，然后标记为已释放
+    static void OnFree(void *ptr);
+
+    // 带大小的回收：还要检查size和申请时一致
+    static void OnFree(void *ptr, size_t size);
+
+    // 检查ptr是正在使用的内存块，返回申请时的大小
+    static size_t UsableSize(void *ptr);
+
+    // cc切好一个span后调用（span还没挂到cc中），nobj是切出的内存块数
+    static void OnSpanCarved(Span *span, size_t nobj);
+
+    // cc把span还给pc之前调用
+    static void OnSpanReleased(Span *span);
+};
+
+#endif
+
+#endif //MEMORY_POOL_MEMORYCHECKER_H
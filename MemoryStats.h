@@ -0,0 +1,38 @@
+#ifndef MEMORY_POOL_MEMORYSTATS_H
+#define MEMORY_POOL_MEMORYSTATS_H
+
+#include "common.h"
+
+// 内存池统计信息，由GetStats()汇总各层的计数得到
+// 各层的计数在平时只是普通的加减（tc中是relaxed原子变量，cc/pc中在已有的锁内），读取时才加锁汇总
+
+// 每个桶（size class）的统计
+struct SizeClassStats {
+    size_t _objsize = 0;            // 内存块大小
+    size_t _threadCacheObjs = 0;    // 所有tc（包括cpu cache）自由链表中缓存的内存块数
+    size_t _transferObjs = 0;       // cc的transfer cache中整批缓存的内存块数
+    size_t _centralSpans = 0;       // cc中持有的span数
+    size_t _centralFreeObjs = 0;    // cc的span上还没分出去的内存块数
+    size_t _appObjs = 0;            // 在应用程序手里的内存块数
+    size_t _fetchCount = 0;         // tc向cc申请的次数
+    size_t _releaseCount = 0;       // tc向cc归还的次数
+};
+
+// pc的统计
+struct PageCacheStats {
+    size_t _freePages[NPAGES] = {0};   // 每个桶中空闲的页数，下标为span的页数
+    size_t _mappedBytes = 0;           // 向系统申请、还没还回去的字节数
+    size_t _largeSpanBytes = 0;        // 超过128页、直接向系统申请的大块内存中正在使用的字节数
+    size_t _largeCachedBytes = 0;      // 超过128页的空闲span缓存的字节数，下次申请大块内存时复用
+    size_t _releasedBytes = 0;         // scavenger累计还给系统的字节数（madvise，缓存的大span是munmap）
+};
+
+struct MemoryPoolStats {
+    size_t _threadCaches = 0;               // 当前存在的tc个数（包括cpu cache的每个CPU）
+    size_t _threadCacheBudget = 0;          // 所有tc一共可以缓存的字节数
+    size_t _threadCacheLimit = 0;           // 各个tc当前缓存上限之和
+    SizeClassStats _sizeClasses[NLISTS];
+    PageCacheStats _pageCache;
+};
+
+#endif //MEMORY_POOL_MEMORYSTATS_H
@@ -2,6 +2,7 @@
 #define MEMORY_POOL_OBJECTPOOL_H
 
 #include <iostream>
+#include "common.h"
 
 using std::cout;
 using std::endl;
@@ -23,19 +24,18 @@ public:
             obj = (T *) _list;
             _list = next;
         } else {
-            if (_remanentBytes < sizeof(T)) {
+            size_t objSize = sizeof(T) < sizeof(void *) ? sizeof(void *) : sizeof(T);
+            if (_remanentBytes < objSize) {
+                // 直接向系统申请，不经过malloc（作为malloc替换库时malloc就是我们自己）
                 _remanentBytes = 128 * 1024;
-                _memory = (char *) malloc(_remanentBytes);
-                if (_memory == nullptr) {
-                    throw std::bad_alloc();
-                }
+                _memory = (char *) SystemAlloc(_remanentBytes >> PAGE_SHIFT);
             }
-        }
 
-        obj = (T *) _memory;
-        size_t objSize = sizeof(T) < sizeof(void *) ? sizeof(void *) : sizeof(T);
-        _memory += objSize;
-        _remanentBytes -= objSize;
+            // 只有没有还回来的对象时，才从大块内存中切
+            obj = (T *) _memory;
+            _memory += objSize;
+            _remanentBytes -= objSize;
+        }
 
         new(obj)T;
         return obj;
@@ -58,4 +58,159 @@ public:
 };
 
 
+// 带线程本地弹匣（magazine）的定长内存池，用于多个线程频繁申请释放同一种对象
+// 每个线程有两个弹匣，各装最多MAGAZINE_SIZE个空闲对象，New/Delete通常只操作本线程的弹匣，不加锁
+// 两个弹匣都空了（或都满了）时才加锁，和共享的仓库（depot）整批交换一个弹匣
+// 同一个T的所有池共用线程本地的弹匣，线程换着用不同的池时，先把弹匣还给上一个池
+// 线程退出时把弹匣还给池，所以池必须比用它的线程活得久；和ObjectPool一样，内存不还给系统
+template<class T, size_t MAGAZINE_SIZE = 64>
+class ThreadCachedObjectPool {
+private:
+    // 空闲对象的开头存链表指针，仓库中每个弹匣第一个对象的第二个指针位置存下一个弹匣
+    static const size_t OBJ_SIZE = sizeof(T) < 2 * sizeof(void *) ? 2 * sizeof(void *)
+                                   : (sizeof(T) + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    // 每次向系统申请的大块内存，至少128K，至少装得下一个弹匣
+    static const size_t SLAB_BYTES = ((OBJ_SIZE * MAGAZINE_SIZE > 128 * 1024 ? OBJ_SIZE * MAGAZINE_SIZE : 128 * 1024)
+                                      + ((size_t) 1 << PAGE_SHIFT) - 1) & ~(((size_t) 1 << PAGE_SHIFT) - 1);
+
+    struct Magazine {
+        void *_list = nullptr;
+        size_t _count = 0;
+    };
+
+    struct ThreadMagazines {
+        Magazine _loaded;   // 正在用的弹匣
+        Magazine _prev;     // 备用的弹匣，只会是空的或满的：在空和满的边界来回申请释放时两个交换，不去仓库
+        ThreadCachedObjectPool *_owner = nullptr;
+
+        ~ThreadMagazines() {
+            if (_owner) {
+                _owner->Drain(*this);
+            }
+        }
+    };
+
+    static thread_local ThreadMagazines _tls;
+
+    std::mutex _depotMtx;
+    void *_fullMagazines = nullptr;  // 仓库中装满的弹匣
+    void *_list = nullptr;           // 零散的空闲对象（线程退出时没装满的弹匣）
+    char *_memory = nullptr;         // 大块内存中还没切的部分
+    size_t _remanentBytes = 0;
+
+    static void *&NextMagazine(void *mag) {
+        return ((void **) mag)[1];
+    }
+
+    // 本线程的弹匣，上次用的是别的池时先还回去
+    ThreadMagazines &Local() {
+        ThreadMagazines &tls = _tls;
+        if (tls._owner != this) {
+            if (tls._owner) {
+                tls._owner->Drain(tls);
+            }
+            tls._owner = this;
+        }
+        return tls;
+    }
+
+    // 从仓库拿一个装满的弹匣，没有就从零散对象和大块内存中凑
+    void Refill(Magazine &mag) {
+        std::unique_lock<std::mutex> lock(_depotMtx);
+        if (_fullMagazines) {
+            mag._list = _fullMagazines;
+            mag._count = MAGAZINE_SIZE;
+            _fullMagazines = NextMagazine(_fullMagazines);
+            return;
+        }
+        while (mag._count < MAGAZINE_SIZE) {
+            void *obj = nullptr;
+            if (_list) {
+                obj = _list;
+                _list = NEXT_OBJ(_list);
+            } else {
+                if (_remanentBytes < OBJ_SIZE) {
+                    _remanentBytes = SLAB_BYTES;
+                    _memory = (char *) SystemAlloc(SLAB_BYTES >> PAGE_SHIFT);
+                }
+                obj = _memory;
+                _memory += OBJ_SIZE;
+                _remanentBytes -= OBJ_SIZE;
+            }
+            NEXT_OBJ(obj) = mag._list;
+            mag._list = obj;
+            ++mag._count;
+        }
+    }
+
+    // 把装满的弹匣放进仓库
+    void PushFull(Magazine &mag) {
+        std::unique_lock<std::mutex> lock(_depotMtx);
+        NextMagazine(mag._list) = _fullMagazines;
+        _fullMagazines = mag._list;
+        mag = Magazine();
+    }
+
+    // 把线程的两个弹匣都还给仓库
+    void Drain(ThreadMagazines &tls) {
+        std::unique_lock<std::mutex> lock(_depotMtx);
+        for (Magazine *mag : {&tls._loaded, &tls._prev}) {
+            if (mag->_count == MAGAZINE_SIZE) {
+                NextMagazine(mag->_list) = _fullMagazines;
+                _fullMagazines = mag->_list;
+            } else if (mag->_count > 0) {
+                void *tail = mag->_list;
+                while (NEXT_OBJ(tail)) {
+                    tail = NEXT_OBJ(tail);
+                }
+                NEXT_OBJ(tail) = _list;
+                _list = mag->_list;
+            }
+            *mag = Magazine();
+        }
+        tls._owner = nullptr;
+    }
+
+public:
+    T *New() {
+        ThreadMagazines &tls = Local();
+        if (tls._loaded._count == 0) {
+            if (tls._prev._count > 0) {
+                std::swap(tls._loaded, tls._prev);
+            } else {
+                Refill(tls._loaded);
+            }
+        }
+
+        void *obj = tls._loaded._list;
+        tls._loaded._list = NEXT_OBJ(obj);
+        --tls._loaded._count;
+
+        new(obj)T;
+        return (T *) obj;
+    }
+
+    void Delete(T *obj) {
+        obj->~T();
+
+        ThreadMagazines &tls = Local();
+        if (tls._loaded._count == MAGAZINE_SIZE) {
+            // 备用的也满了，先放进仓库，再把满的弹匣换到备用
+            if (tls._prev._count > 0) {
+                PushFull(tls._prev);
+            }
+            std::swap(tls._loaded, tls._prev);
+        }
+
+        NEXT_OBJ(obj) = tls._loaded._list;
+        tls._loaded._list = obj;
+        ++tls._loaded._count;
+    }
+};
+
+template<class T, size_t MAGAZINE_SIZE>
+thread_local typename ThreadCachedObjectPool<T, MAGAZINE_SIZE>::ThreadMagazines
+        ThreadCachedObjectPool<T, MAGAZINE_SIZE>::_tls;
+
+
 #endif //MEMORY_POOL_OBJECTPOOL_H
@@ -6,102 +6,409 @@
 // 单例
 PageCache PageCache::_inst;
 
+bool
+PageCache::HugePageEnabled() {
+    static const bool enabled = EnvEnabled("MEMPOOL_HUGEPAGE");
+    return enabled;
+}
+
+// 向系统申请一个2M对齐的大页
+// 优先用hugetlbfs预留的大页（MAP_HUGETLB），没有预留时退化为普通的2M对齐内存 + MADV_HUGEPAGE
+static void *SystemAllocHugePage() {
+    size_t bytes = (size_t) 1 << HUGEPAGE_SHIFT;
+#if defined(MAP_HUGETLB)
+    void *ptr = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        return ptr;
+    }
+#endif
+    void *aligned = SystemAllocAligned(HUGEPAGE_NPAGES, bytes);
+#if defined(MADV_HUGEPAGE)
+    madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+Span *
+PageCache::SplitSpan(Span *nSpan, size_t k) {
+    assert (nSpan->_npage >= k);
+    if (nSpan->_npage == k) {
+        nSpan->_isUse = true;
+        for (PageID i = 0; i < nSpan->_npage; ++i) {
+            _idspanmap.Set(nSpan->_pageid + i, nSpan);
+        }
+        return nSpan;
+    }
+
+//    Span *kSpan = new Span;
+    Span *kSpan = _spanPool.New();
+
+    // 从nSpan头部切下k页给kSpan
+    kSpan->_pageid = nSpan->_pageid;
+    kSpan->_npage = k;
+    kSpan->_isUse = true;
+    kSpan->_zeroed = nSpan->_zeroed;
+
+    nSpan->_pageid += k;
+    nSpan->_npage -= k;
+
+    PushSpan(nSpan);
+
+    // 空闲的span只需要映射首尾页，用于合并时查找相邻span
+    _idspanmap.Set(nSpan->_pageid, nSpan);
+    _idspanmap.Set(nSpan->_pageid + nSpan->_npage - 1, nSpan);
+
+    // 分配出去的span每一页都要映射，用于释放时通过地址找span
+    for (PageID i = 0; i < kSpan->_npage; ++i) {
+        _idspanmap.Set(kSpan->_pageid + i, kSpan);
+    }
+    return kSpan;
+}
+
+Span *
+PageCache::FindSpanInHugePage(PageID hint, size_t k) {
+    // 大页模式下span不会跨大页（合并时保证），大页内的每一页都属于某个span，
+    // 且span的首页一定有映射，所以可以从大页的第一页开始按span依次往后走
+    PageID begin = hint & ~(PageID) (HUGEPAGE_NPAGES - 1);
+    PageID end = begin + HUGEPAGE_NPAGES;
+    for (PageID id = begin; id < end;) {
+        Span *span = _idspanmap.Get(id);
+        if (span == nullptr || span->_pageid != id) {
+            return nullptr;
+        }
+        if (!span->_isUse && span->_npage >= k) {
+            return span;
+        }
+        id += span->_npage;
+    }
+    return nullptr;
+}
+
+void
+PageCache::AllocHugePage() {
+    void *ptr = SystemAllocHugePage();
+    _mappedBytes += (size_t) 1 << HUGEPAGE_SHIFT;
+    PageID start = ((PageID) ptr) >> PAGE_SHIFT;
+    _idspanmap.Ensure(start, HUGEPAGE_NPAGES);
+
+    // 一个大页256页，span最多128页，切成两个
+    for (PageID id = start; id < start + HUGEPAGE_NPAGES; id += NPAGES - 1) {
+        Span *span = _spanPool.New();
+        span->_pageid = id;
+        span->_npage = NPAGES - 1;
+        span->_zeroed = true;
+        PushSpan(span);
+        _idspanmap.Set(span->_pageid, span);
+        _idspanmap.Set(span->_pageid + span->_npage - 1, span);
+    }
+}
+
+size_t
+PageCache::LargeCacheBudget() {
+    static const size_t budget = [] {
+        const char *env = getenv("MEMPOOL_LARGE_CACHE");
+        if (env != nullptr && env[0] != '\0') {
+            return (size_t) strtoull(env, nullptr, 10);
+        }
+        return LARGE_CACHE_BUDGET;
+    }();
+    return budget;
+}
+
+Span *
+PageCache::NewLargeSpanFromCache(size_t k) {
+    // 最佳适配：大小正好的优先，否则找最小的够用的，减少切剩下的碎片
+    Span *best = nullptr;
+    for (Span *it = _largeSpans.Begin(); it != _largeSpans.End(); it = it->_next) {
+        if (it->_npage >= k && (best == nullptr || it->_npage < best->_npage)) {
+            best = it;
+            if (it->_npage == k) {
+                break;
+            }
+        }
+    }
+    if (best == nullptr) {
+        return nullptr;
+    }
+
+    size_t rest = best->_npage - k;
+    Span *span = best;
+    if (rest > NPAGES - 1) {
+        // 剩下的还超过128页：切下尾部的k页，头部留在缓存中，地址顺序不变
+        span = _spanPool.New();
+        span->_pageid = best->_pageid + rest;
+        span->_npage = k;
+        span->_zeroed = best->_zeroed;
+        best->_npage = rest;
+        _largeCachedBytes -= k << PAGE_SHIFT;
+    } else {
+        // 剩下的不超过128页时不切，整个给出去：切下来的小span挂进pc的桶后就再也不会munmap了
+        _largeSpans.Erase(best);
+        _largeCachedBytes -= best->_npage << PAGE_SHIFT;
+    }
+    span->_isUse = true;
+    _largeSpanBytes += span->_npage << PAGE_SHIFT;
+    // 和直接向系统申请的一样，映射首尾两页；节点在当初申请时已经建好
+    _idspanmap.Set(span->_pageid, span);
+    _idspanmap.Set(span->_pageid + span->_npage - 1, span);
+    return span;
+}
+
+void
+PageCache::ReleaseLargeSpan(Span *span) {
+    // 缓存中的span不在基数树中，不会和pc桶中相邻的span合并，野指针也查不到它
+    _idspanmap.Set(span->_pageid, nullptr);
+    _idspanmap.Set(span->_pageid + span->_npage - 1, nullptr);
+    _largeSpanBytes -= span->_npage << PAGE_SHIFT;
+    span->_isUse = false;
+    span->_freeTime = NowMs();
+
+    size_t budget = LargeCacheBudget();
+    if ((span->_npage << PAGE_SHIFT) > budget) {
+        UnmapLargeSpan(span);
+        return;
+    }
+
+    // 按地址插入
+    Span *next = _largeSpans.Begin();
+    while (next != _largeSpans.End() && next->_pageid < span->_pageid) {
+        next = next->_next;
+    }
+    _largeSpans.Insert(next, span);
+    _largeCachedBytes += span->_npage << PAGE_SHIFT;
+
+    // 和地址相邻的合并：相邻的两次mmap可以当作一段使用，munmap也可以跨过它们
+    // 合并后的空闲时间取较早的一个，已经空闲很久的内存不会因为和新还回来的合并而一直留在缓存里
+    Span *prev = span->_prev;
+    if (prev != _largeSpans.End() && prev->_pageid + prev->_npage == span->_pageid) {
+        prev->_npage += span->_npage;
+        prev->_zeroed = prev->_zeroed && span->_zeroed;
+        prev->_freeTime = min(prev->_freeTime, span->_freeTime);
+        _largeSpans.Erase(span);
+        _spanPool.Delete(span);
+        span = prev;
+    }
+    if (next != _largeSpans.End() && span->_pageid + span->_npage == next->_pageid) {
+        span->_npage += next->_npage;
+        span->_zeroed = span->_zeroed && next->_zeroed;
+        span->_freeTime = min(span->_freeTime, next->_freeTime);
+        _largeSpans.Erase(next);
+        _spanPool.Delete(next);
+    }
+
+    // 超过预算时从空闲最久的开始还给系统
+    while (_largeCachedBytes > budget) {
+        Span *oldest = _largeSpans.Begin();
+        for (Span *it = oldest->_next; it != _largeSpans.End(); it = it->_next) {
+            if (it->_freeTime < oldest->_freeTime) {
+                oldest = it;
+            }
+        }
+        _largeSpans.Erase(oldest);
+        _largeCachedBytes -= oldest->_npage << PAGE_SHIFT;
+        UnmapLargeSpan(oldest);
+    }
+}
+
+void
+PageCache::UnmapLargeSpan(Span *span) {
+    _mappedBytes -= span->_npage << PAGE_SHIFT;
+    SystemFree((void *) (span->_pageid << PAGE_SHIFT), span->_npage);
+    _spanPool.Delete(span);
+}
+
 // pc从自己的哈希桶中拿出来一个k页的span
 // k：申请的页数
 Span *
-PageCache::NewSpan(size_t k) {
+PageCache::NewSpan(size_t k, PageID hint) {
     // pc检查自己第k个桶里面有没有span
     // 情况1：有：返回一个span
     // 情况2：没有：往下找更大页的桶中的span，拿出来拆开
     // 如：id（起始页号） + n（管理页数）的span 拆成id + k 和 id + k  +  n - k 两个span
     // 情况3：还没有：向系统申请一个128页的span并切分，返回所需要的k页span
-    // 情况4：单次申请超过128页：直接向系统申请
+    // 情况4：单次申请超过128页：先从缓存的大span中找，没有再直接向系统申请
 
     assert (k > 0);
 
     // 情况4
     if (k > NPAGES - 1) {
+        Span *cached = NewLargeSpanFromCache(k);
+        if (cached) {
+            return cached;
+        }
         void *ptr = SystemAlloc(k);
+        _mappedBytes += k << PAGE_SHIFT;
+        _largeSpanBytes += k << PAGE_SHIFT;
 //        Span *span = new Span;
         Span *span = _spanPool.New();
         span->_pageid = ((PageID) ptr) >> PAGE_SHIFT;
         span->_npage = k;
-        _idspanmap[span->_pageid] = span;
-        _idspanmap[span->_pageid + span->_npage] = span;
+        span->_isUse = true;
+        span->_zeroed = true;
+        // 大块内存只会通过首页地址释放，映射首尾两页即可
+        _idspanmap.Ensure(span->_pageid, span->_npage);
+        _idspanmap.Set(span->_pageid, span);
+        _idspanmap.Set(span->_pageid + span->_npage - 1, span);
         return span;
     }
 
-    // 情况1
-    if (!_spanlist[k].Empty()) {
-        Span *span = _spanlist[k].PopFront();
-        for (PageID i = 0; i < span->_npage; ++i) {
-            _idspanmap[span->_pageid + i] = span;
+    // 大页模式：先在调用方上一个span所在的大页中找，同一个桶的span尽量挤在同一个大页里
+    if (hint != 0 && HugePageEnabled()) {
+        Span *span = FindSpanInHugePage(hint, k);
+        if (span) {
+            EraseSpan(span);
+            return SplitSpan(span, k);
         }
-        return span;
     }
 
-    // 情况2
-    for (size_t i = k + 1; i < NPAGES; ++i) {
-        if (!_spanlist[i].Empty()) {
-            Span *nSpan = _spanlist[i].PopFront();
-//            Span *kSpan = new Span;
-            Span *kSpan = _spanPool.New();
-
-            kSpan->_pageid = nSpan->_pageid;
-            kSpan->_npage = k;
-
-            nSpan->_pageid += k;
-            nSpan->_npage -= k;
-
-            kSpan->_pageid = nSpan->_pageid;
-            kSpan->_npage = k;
-
-            _spanlist[nSpan->_npage].PushFront(nSpan);
-
-            _idspanmap[nSpan->_pageid] = nSpan;
-            _idspanmap[nSpan->_pageid + nSpan->_npage - 1] = nSpan;
-
-            for (PageID i = 0; i < kSpan->_npage; ++i) {
-                _idspanmap[kSpan->_pageid + i] = kSpan;
-            }
-            return kSpan;
-        }
+    // 情况1、情况2：通过位图直接找到第一个不小于k页的非空桶
+    size_t i = FindNonEmptyBucket(k);
+    if (i < NPAGES) {
+        Span *nSpan = PopSpan(i);
+        return SplitSpan(nSpan, k);
     }
 
     // 情况3
+    if (HugePageEnabled()) {
+        AllocHugePage();
+        return NewSpan(k);
+    }
     void *ptr = SystemAlloc(NPAGES - 1);
+    _mappedBytes += (NPAGES - 1) << PAGE_SHIFT;
 //    Span *bigSpan = new Span;
     Span *bigSpan = _spanPool.New();
     bigSpan->_pageid = (((PageID) ptr) >> PAGE_SHIFT);
     bigSpan->_npage = NPAGES - 1;
-    _spanlist[bigSpan->_npage].PushFront(bigSpan);
+    bigSpan->_zeroed = true;
+    PushSpan(bigSpan);
 
-//    _idspanmap[bigSpan->_pageid] = bigSpan;
-//    _idspanmap[bigSpan->_pageid + bigSpan->_npage - 1] = bigSpan;
+    // 新申请的这段内存先把基数树节点建好，之后的Set都不需要再分配节点
+    _idspanmap.Ensure(bigSpan->_pageid, bigSpan->_npage);
+    _idspanmap.Set(bigSpan->_pageid, bigSpan);
+    _idspanmap.Set(bigSpan->_pageid + bigSpan->_npage - 1, bigSpan);
     return NewSpan(k);
 }
 
+Span *
+PageCache::NewAlignedSpan(size_t k, size_t alignPages) {
+    assert (k > 0);
+    assert (alignPages > 0 && (alignPages & (alignPages - 1)) == 0);
+    if (alignPages == 1) {
+        return NewSpan(k);
+    }
+
+    // 多拿的页数超过了pc能管理的128页，直接向系统申请对齐的内存
+    if (k + alignPages - 1 > NPAGES - 1) {
+        void *ptr = SystemAllocAligned(k, alignPages << PAGE_SHIFT);
+        _mappedBytes += k << PAGE_SHIFT;
+        Span *span = _spanPool.New();
+        span->_pageid = ((PageID) ptr) >> PAGE_SHIFT;
+        span->_npage = k;
+        span->_isUse = true;
+        span->_zeroed = true;
+        _idspanmap.Ensure(span->_pageid, span->_npage);
+        if (k > NPAGES - 1) {
+            // 和情况4一样，释放时直接还给系统
+            _largeSpanBytes += k << PAGE_SHIFT;
+            _idspanmap.Set(span->_pageid, span);
+            _idspanmap.Set(span->_pageid + span->_npage - 1, span);
+        } else {
+            // 不超过128页，释放时和普通span一样挂进pc
+            for (PageID i = 0; i < span->_npage; ++i) {
+                _idspanmap.Set(span->_pageid + i, span);
+            }
+        }
+        return span;
+    }
+
+    Span *span = NewSpan(k + alignPages - 1);
+    PageID start = span->_pageid;
+    PageID end = start + span->_npage;
+    PageID alignedId = (start + alignPages - 1) & ~(PageID) (alignPages - 1);
+
+    // 中间对齐的k页继续用原来的span
+    span->_pageid = alignedId;
+    span->_npage = k;
+
+    // 首尾多出来的页切成新的span还给pc，还之前先把它们的页映射到自己身上
+    PageID trims[2][2] = {{start, alignedId}, {alignedId + k, end}};
+    for (auto &trim : trims) {
+        if (trim[0] == trim[1]) {
+            continue;
+        }
+        Span *trimSpan = _spanPool.New();
+        trimSpan->_pageid = trim[0];
+        trimSpan->_npage = trim[1] - trim[0];
+        trimSpan->_isUse = true;
+        trimSpan->_zeroed = span->_zeroed;
+        for (PageID i = trim[0]; i < trim[1]; ++i) {
+            _idspanmap.Set(i, trimSpan);
+        }
+        ReleaseSpanToPageCache(trimSpan);
+    }
+    return span;
+}
+
+bool
+PageCache::GrowSpan(Span *span, size_t k) {
+    assert (span->_isUse);
+    if (k <= span->_npage) {
+        return true;
+    }
+    if (span->_npage > NPAGES - 1 || k > NPAGES - 1) {
+        return false;
+    }
+
+    // 和合并时一样，通过右边第一页找相邻span
+    PageID rightId = span->_pageid + span->_npage;
+    Span *rightSpan = _idspanmap.Get(rightId);
+    if (rightSpan == nullptr || rightSpan->_isUse || rightSpan->_pageid != rightId) {
+        return false;
+    }
+    size_t need = k - span->_npage;
+    if (rightSpan->_npage < need) {
+        return false;
+    }
+    // 大页模式下span不跨大页
+    if (HugePageEnabled() && (rightId + need - 1) / HUGEPAGE_NPAGES != span->_pageid / HUGEPAGE_NPAGES) {
+        return false;
+    }
+
+    EraseSpan(rightSpan);
+    if (rightSpan->_npage == need) {
+        _spanPool.Delete(rightSpan);
+    } else {
+        rightSpan->_pageid += need;
+        rightSpan->_npage -= need;
+        PushSpan(rightSpan);
+        _idspanmap.Set(rightSpan->_pageid, rightSpan);
+        _idspanmap.Set(rightSpan->_pageid + rightSpan->_npage - 1, rightSpan);
+    }
+
+    for (PageID i = rightId; i < rightId + need; ++i) {
+        _idspanmap.Set(i, span);
+    }
+    span->_npage = k;
+    return true;
+}
+
 // 管理cc还回来的span
 void
 PageCache::ReleaseSpanToPageCache(Span *span) {
     if (span->_npage > NPAGES - 1) {
-        void *ptr = (void *) (span->_pageid << PAGE_SHIFT);
-        SystemFree(ptr);
-//        delete span;
-        _spanPool.Delete(span);
+        ReleaseLargeSpan(span);
         return;
     }
     // 向左不断合并
     while (1) {
         PageID leftId = span->_pageid - 1;
-        auto it = _idspanmap.find(leftId);
+        Span *leftSpan = _idspanmap.Get(leftId);
 
         // 没有相邻span，停止合并
-        if (it == _idspanmap.end()) {
+        if (leftSpan == nullptr) {
             break;
         }
 
-        Span *leftSpan = it->second;
         // 相邻span在cc中，停止合并
         if (leftSpan->_isUse) {
             break;
@@ -110,24 +417,28 @@ PageCache::ReleaseSpanToPageCache(Span *span) {
         if (leftSpan->_npage + span->_npage > NPAGES - 1) {
             break;
         }
-        // 合并
+        // 大页模式下不跨大页合并
+        if (HugePageEnabled() && leftSpan->_pageid / HUGEPAGE_NPAGES != span->_pageid / HUGEPAGE_NPAGES) {
+            break;
+        }
+        // 合并，两边都全为0时合并后才全为0
         span->_npage += leftSpan->_npage;
         span->_pageid = leftSpan->_pageid;
-        _spanlist[leftSpan->_npage].Erase(leftSpan);
+        span->_zeroed = span->_zeroed && leftSpan->_zeroed;
+        EraseSpan(leftSpan);
 //        delete leftSpan;
         _spanPool.Delete(leftSpan);
     }
     // 向右不断合并
     while (1) {
         PageID rightId = span->_pageid + span->_npage;
-        auto it = _idspanmap.find(rightId);
+        Span *rightSpan = _idspanmap.Get(rightId);
 
         // 没有相邻span，停止合并
-        if (it == _idspanmap.end()) {
+        if (rightSpan == nullptr) {
             break;
         }
 
-        Span *rightSpan = it->second;
         // 相邻span在cc中，停止合并
         if (rightSpan->_isUse) {
             break;
@@ -136,31 +447,89 @@ PageCache::ReleaseSpanToPageCache(Span *span) {
         if (rightSpan->_npage + span->_npage > NPAGES - 1) {
             break;
         }
+        // 大页模式下不跨大页合并
+        if (HugePageEnabled() && rightSpan->_pageid / HUGEPAGE_NPAGES != span->_pageid / HUGEPAGE_NPAGES) {
+            break;
+        }
         // 合并
         span->_npage += rightSpan->_npage;
-        _spanlist[rightSpan->_npage].Erase(rightSpan);
+        span->_zeroed = span->_zeroed && rightSpan->_zeroed;
+        EraseSpan(rightSpan);
 //        delete rightSpan;
         _spanPool.Delete(rightSpan);
     }
 
     // 合并完成，将当前span挂到桶中
-    _spanlist[span->_npage].PushFront(span);
+    PushSpan(span);
     span->_isUse = false;
+    // 合并后的span中有刚用过的页，不再算已经还给系统
+    span->_released = false;
+    span->_freeTime = NowMs();
 
-    _idspanmap[span->_pageid] = span;
-    _idspanmap[span->_pageid + span->_npage - 1] = span;
+    _idspanmap.Set(span->_pageid, span);
+    _idspanmap.Set(span->_pageid + span->_npage - 1, span);
 }
 
 //获取从对象到span的映射
 Span *
 PageCache::MapObjectToSpan(void *obj) {
     PageID id = (((PageID) obj) >> PAGE_SHIFT);
-    std::unique_lock<std::mutex> lock(_pageMtx);          // 智能锁
-    auto it = _idspanmap.find(id);
-    if (it != _idspanmap.end()) {
-        return it->second;
-    } else {
-        assert(false);
-        return nullptr;
+    // 基数树的读不需要加锁：obj所在的span在分配出去之前已经完成了映射
+    Span *span = _idspanmap.Get(id);
+    assert (span);
+    return span;
+}
+
+void
+PageCache::GetStats(PageCacheStats &stats) {
+    std::unique_lock<std::mutex> lock(_pageMtx);
+    for (size_t i = 1; i < NPAGES; ++i) {
+        for (Span *it = _spanlist[i].Begin(); it != _spanlist[i].End(); it = it->_next) {
+            stats._freePages[i] += it->_npage;
+        }
+    }
+    stats._mappedBytes = _mappedBytes;
+    stats._largeSpanBytes = _largeSpanBytes;
+    stats._largeCachedBytes = _largeCachedBytes;
+    stats._releasedBytes = _releasedBytes;
+}
+
+size_t
+PageCache::ReleaseIdlePages(uint64_t idleMs, size_t maxPages) {
+    uint64_t now = NowMs();
+    size_t released = 0;
+    // 缓存的超过128页的span直接munmap
+    for (Span *it = _largeSpans.Begin(); it != _largeSpans.End();) {
+        Span *next = it->_next;
+        if (maxPages != 0 && released >= maxPages) {
+            return released;
+        }
+        if (now - it->_freeTime >= idleMs) {
+            _largeSpans.Erase(it);
+            _largeCachedBytes -= it->_npage << PAGE_SHIFT;
+            released += it->_npage;
+            _releasedBytes += it->_npage << PAGE_SHIFT;
+            UnmapLargeSpan(it);
+        }
+        it = next;
+    }
+    // 从大span往小span还，大span更可能是流量高峰过后合并出来的整块
+    for (size_t i = NPAGES - 1; i > 0; --i) {
+        for (Span *it = _spanlist[i].Begin(); it != _spanlist[i].End(); it = it->_next) {
+            if (maxPages != 0 && released >= maxPages) {
+                return released;
+            }
+            if (it->_released || now - it->_freeTime < idleMs) {
+                continue;
+            }
+            if (!SystemRelease((void *) (it->_pageid << PAGE_SHIFT), it->_npage)) {
+                continue;
+            }
+            it->_released = true;
+            it->_zeroed = true;
+            released += it->_npage;
+            _releasedBytes += it->_npage << PAGE_SHIFT;
+        }
     }
-}
\ No newline at end of file
+    return released;
+}
@@ -2,6 +2,8 @@
 #define MEMORY_POOL_PAGECACHE_H
 
 #include "common.h"
+#include "PageMap.h"
+#include "MemoryStats.h"
 
 // Page Cache:单例饿汉
 // 单例：Central Cache获取span的时候，每次都是从同一个page数组中获取span
@@ -11,7 +13,7 @@ public:
         return &_inst;
     }
 private:
-    PageCache() {}
+    constexpr PageCache() {}
     PageCache(const PageCache &) = delete;
     PageCache &operator=(const PageCache &) = delete;
     static PageCache _inst;
@@ -25,14 +27,40 @@ public:
 //    void FreeBigPageObj(void *ptr, Span *span);
 //
     // pc从自己的哈希桶中拿出来一个k页的span
-    Span* NewSpan(size_t k);
+    // hint：调用方上一次拿到的span的页号，大页模式下优先从同一个大页中切，0表示没有
+    Span* NewSpan(size_t k, PageID hint = 0);
 
-    // 通过页地址招span
+    // 是否启用透明大页：设置环境变量 MEMPOOL_HUGEPAGE=1 后，
+    // pc每次向系统申请按2M对齐的2M内存，并提示内核用大页，同一个桶的span尽量切在同一个大页里
+    static bool HugePageEnabled();
+
+    // 拿出一个k页、首页页号是alignPages倍数的span（alignPages为2的幂）
+    // 从pc中多拿alignPages - 1页，切掉首尾不对齐的部分还回pc；太大时直接向系统申请对齐的内存
+    Span* NewAlignedSpan(size_t k, size_t alignPages);
+
+    // 把正在使用的span原地扩大到k页：右边相邻的span空闲且够大时，从它头部切下需要的页并进来
+    // 成功返回true；span超过128页（直接向系统申请的）或右边没有足够的空闲页时返回false
+    bool GrowSpan(Span *span, size_t k);
+
+    // 通过页地址招span，不加锁
     Span *MapObjectToSpan(void *obj);
 
+    // 和MapObjectToSpan一样，obj不在任何span中时返回nullptr，不assert（检查模式用来识别野指针）
+    Span *LookupSpan(void *obj) {
+        return _idspanmap.Get(((PageID) obj) >> PAGE_SHIFT);
+    }
+
     // 管理cc还回来的span
     void ReleaseSpanToPageCache(Span *span);
 
+    // 统计每个桶的空闲页数和向系统申请的内存，内部加锁
+    void GetStats(PageCacheStats &stats);
+
+    // scavenger：把在pc中空闲超过idleMs毫秒的span的物理页还给系统（madvise），最多还maxPages页
+    // 缓存的超过128页的span空闲超过idleMs毫秒时直接munmap
+    // maxPages为0表示不限；返回这次还回去的页数；调用方需持有pc锁
+    size_t ReleaseIdlePages(uint64_t idleMs, size_t maxPages);
+
     void Lock() {
         _pageMtx.lock();
     }
@@ -42,10 +70,78 @@ public:
     }
 
 private:
+    // 从已经取出桶的nSpan头部切下k页返回，剩下的挂回桶中
+    Span *SplitSpan(Span *nSpan, size_t k);
+
+    // 大页模式：在hint所在的大页中找一个至少k页的空闲span，没有返回nullptr
+    Span *FindSpanInHugePage(PageID hint, size_t k);
+
+    // 大页模式：向系统申请一个2M的大页，切成两个128页的span挂到桶中
+    void AllocHugePage();
+
+    // 超过128页的空闲span缓存的字节数上限，默认LARGE_CACHE_BUDGET
+    // 可以通过环境变量 MEMPOOL_LARGE_CACHE=字节数 设置，0表示不缓存，每次都munmap
+    static size_t LargeCacheBudget();
+
+    // 从大span缓存中找一个至少k页的span（最佳适配），没有返回nullptr
+    // 多出来的超过128页时切下k页，否则整个返回
+    Span *NewLargeSpanFromCache(size_t k);
+
+    // 超过128页的span还回来：按地址插入缓存并和相邻的合并，超过预算时把空闲最久的munmap
+    void ReleaseLargeSpan(Span *span);
+
+    // 把超过128页的span还给系统
+    void UnmapLargeSpan(Span *span);
+
+    // 桶的挂入和摘除都通过下面三个函数，同时维护_nonEmpty
+    void PushSpan(Span *span) {
+        _spanlist[span->_npage].PushFront(span);
+        _nonEmpty[span->_npage / 64] |= (uint64_t) 1 << (span->_npage % 64);
+    }
+
+    void EraseSpan(Span *span) {
+        _spanlist[span->_npage].Erase(span);
+        if (_spanlist[span->_npage].Empty()) {
+            _nonEmpty[span->_npage / 64] &= ~((uint64_t) 1 << (span->_npage % 64));
+        }
+    }
+
+    Span *PopSpan(size_t i) {
+        Span *span = _spanlist[i].Begin();
+        EraseSpan(span);
+        return span;
+    }
+
+    // 第一个不小于k的非空桶，都为空时返回NPAGES
+    size_t FindNonEmptyBucket(size_t k) const {
+        for (size_t w = k / 64; w < NONEMPTY_WORDS; ++w) {
+            uint64_t bits = _nonEmpty[w];
+            if (w == k / 64) {
+                bits &= ~(uint64_t) 0 << (k % 64);   // 去掉小于k的桶
+            }
+            if (bits != 0) {
+                return w * 64 + __builtin_ctzll(bits);
+            }
+        }
+        return NPAGES;
+    }
+
+    static const size_t NONEMPTY_WORDS = (NPAGES + 63) / 64;
+
     SpanList _spanlist[NPAGES];
+    uint64_t _nonEmpty[NONEMPTY_WORDS] = {};   // 第i位为1表示_spanlist[i]不为空，NewSpan不用逐个桶检查
+    // 超过128页的空闲span，按地址排序，用span自己的_prev/_next串起来，不经过malloc
+    // 个数受预算限制（默认64M，每个至少1M），查找和插入直接遍历
+    SpanList _largeSpans;
     std::mutex _pageMtx;
-    std::unordered_map<PageID, Span *> _idspanmap;
+    PageMap3<PAGEMAP_BITS> _idspanmap;    // 页号 -> span，只在持有_pageMtx时写
     ObjectPool<Span> _spanPool;
+
+    // 统计，在_pageMtx内修改
+    size_t _mappedBytes = 0;      // 向系统申请、还没还回去的字节数
+    size_t _largeSpanBytes = 0;   // 超过128页的大块内存中正在使用的字节数
+    size_t _releasedBytes = 0;    // scavenger累计还给系统的字节数
+    size_t _largeCachedBytes = 0; // _largeSpans中的字节数
 };
 
 #endif //MEMORY_POOL_PAGECACHE_H
\ No newline at end of file
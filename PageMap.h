@@ -0,0 +1,96 @@
+#ifndef MEMORY_POOL_PAGEMAP_H
+#define MEMORY_POOL_PAGEMAP_H
+
+#include <atomic>
+#include "common.h"
+
+// 页号的有效位数：64位下用户态地址48位，32位下32位
+static const int PAGEMAP_BITS = sizeof(void *) == 8 ? 48 - PAGE_SHIFT : 32 - PAGE_SHIFT;
+
+// 三层基数树：页号 -> Span*，用来替代unordered_map
+// 页号按bit拆成三段，分别索引根节点、中间节点和叶子节点
+// 写（Ensure/Set）只在持有pc锁时进行；读（Get）不加锁
+// 节点一旦建立就不再释放，所以读者拿到的节点指针永远有效
+template<int BITS>
+class PageMap3 {
+private:
+    static const int INTERIOR_BITS = (BITS + 2) / 3;          // 根节点和中间节点的位数
+    static const int INTERIOR_LENGTH = 1 << INTERIOR_BITS;
+    static const int LEAF_BITS = BITS - 2 * INTERIOR_BITS;    // 叶子节点的位数
+    static const int LEAF_LENGTH = 1 << LEAF_BITS;
+
+    struct Leaf {
+        std::atomic<Span *> _values[LEAF_LENGTH];
+    };
+
+    struct Node {
+        std::atomic<Leaf *> _leafs[INTERIOR_LENGTH];
+    };
+
+    std::atomic<Node *> _root[INTERIOR_LENGTH] = {};   // 根节点直接放在对象里，全为0
+
+    // 节点直接向系统申请，mmap出来的内存全是0，不经过malloc
+    template<class T>
+    static T *NewNode() {
+        size_t kpage = (sizeof(T) + (1 << PAGE_SHIFT) - 1) >> PAGE_SHIFT;
+        return (T *) SystemAlloc(kpage);
+    }
+
+public:
+    // 查找页号对应的span，没有映射返回nullptr，不加锁
+    Span *Get(PageID id) const {
+        if ((id >> BITS) > 0) {
+            return nullptr;
+        }
+        const size_t i1 = id >> (LEAF_BITS + INTERIOR_BITS);
+        const size_t i2 = (id >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+        const size_t i3 = id & (LEAF_LENGTH - 1);
+
+        Node *node = _root[i1].load(std::memory_order_acquire);
+        if (node == nullptr) {
+            return nullptr;
+        }
+        Leaf *leaf = node->_leafs[i2].load(std::memory_order_acquire);
+        if (leaf == nullptr) {
+            return nullptr;
+        }
+        return leaf->_values[i3].load(std::memory_order_acquire);
+    }
+
+    // 建立页号 id 对应的映射，调用前必须对[id, id + n)调用过Ensure
+    void Set(PageID id, Span *span) {
+        assert ((id >> BITS) == 0);
+        const size_t i1 = id >> (LEAF_BITS + INTERIOR_BITS);
+        const size_t i2 = (id >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+        const size_t i3 = id & (LEAF_LENGTH - 1);
+
+        Node *node = _root[i1].load(std::memory_order_relaxed);
+        assert (node);
+        Leaf *leaf = node->_leafs[i2].load(std::memory_order_relaxed);
+        assert (leaf);
+        leaf->_values[i3].store(span, std::memory_order_release);
+    }
+
+    // 保证[start, start + n)这段页号的节点都已经建立
+    void Ensure(PageID start, size_t n) {
+        for (PageID key = start; key < start + n;) {
+            assert ((key >> BITS) == 0);
+            const size_t i1 = key >> (LEAF_BITS + INTERIOR_BITS);
+            const size_t i2 = (key >> LEAF_BITS) & (INTERIOR_LENGTH - 1);
+
+            Node *node = _root[i1].load(std::memory_order_relaxed);
+            if (node == nullptr) {
+                node = NewNode<Node>();
+                _root[i1].store(node, std::memory_order_release);
+            }
+            if (node->_leafs[i2].load(std::memory_order_relaxed) == nullptr) {
+                node->_leafs[i2].store(NewNode<Leaf>(), std::memory_order_release);
+            }
+
+            // 跳到下一个叶子节点覆盖的起始页号
+            key = ((key >> LEAF_BITS) + 1) << LEAF_BITS;
+        }
+    }
+};
+
+#endif //MEMORY_POOL_PAGEMAP_H
@@ -0,0 +1,68 @@
+#ifndef MEMORY_POOL_POOLALLOCATOR_H
+#define MEMORY_POOL_POOLALLOCATOR_H
+
+#include <limits>
+#include <new>
+#include <type_traits>
+#include "ConcurrentAlloc.h"
+
+// 满足标准Allocator要求的分配器，让STL容器不通过LD_PRELOAD也能用内存池
+// 如 std::map<K, V, std::less<K>, PoolAllocator<std::pair<const K, V>>>，容器内部rebind到节点类型
+// 分配器没有状态，所有PoolAllocator都相等，容器拷贝/移动/交换时不需要逐个元素重新分配
+template<class T>
+class PoolAllocator {
+public:
+    typedef T value_type;
+    typedef size_t size_type;
+    typedef ptrdiff_t difference_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+    typedef std::true_type is_always_equal;
+
+    template<class U>
+    struct rebind {
+        typedef PoolAllocator<U> other;
+    };
+
+    PoolAllocator() noexcept = default;
+
+    template<class U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n) {
+        if (n > max_size()) {
+            throw std::bad_array_new_length();
+        }
+        // 128字节以下的桶只保证8字节对齐，对齐要求更高的类型走对齐申请
+        if (alignof(T) > 8) {
+            return (T*) ConcurrentAllocAligned(n * sizeof(T), alignof(T));
+        }
+        return (T*) ConcurrentAlloc(n * sizeof(T));
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        // 容器还回来时一定带着申请时的个数，小块内存按size直接找桶，不查span
+        if (alignof(T) > 8) {
+            ConcurrentFree(p);
+        } else {
+            ConcurrentFree(p, n * sizeof(T));
+        }
+    }
+
+    size_t max_size() const noexcept {
+        return std::numeric_limits<size_t>::max() / sizeof(T);
+    }
+};
+
+template<class T, class U>
+bool operator==(const PoolAllocator<T>&, const PoolAllocator<U>&) noexcept {
+    return true;
+}
+
+template<class T, class U>
+bool operator!=(const PoolAllocator<T>&, const PoolAllocator<U>&) noexcept {
+    return false;
+}
+
+#endif //MEMORY_POOL_POOLALLOCATOR_H
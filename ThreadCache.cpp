@@ -1,6 +1,181 @@
 #include "ThreadCache.h"
 #include "CentralCache.h"
 
+ThreadCache* ThreadCache::_allCaches = nullptr;
+std::mutex ThreadCache::_allCachesMtx;
+size_t ThreadCache::_overallBudget = THREAD_CACHE_BUDGET;
+std::atomic<ptrdiff_t> ThreadCache::_unclaimedBudget{THREAD_CACHE_BUDGET};
+ThreadCache* ThreadCache::_nextSteal = nullptr;
+
+ThreadCache::ThreadCache() {
+    std::unique_lock<std::mutex> lock(_allCachesMtx);
+    InitBudgetLocked();
+    _nextCache = _allCaches;
+    if (_allCaches) {
+        _allCaches->_prevCache = this;
+    }
+    _allCaches = this;
+
+    // 新的tc至少有MIN_THREAD_CACHE_SIZE的上限，预算不够时也给，之后从其他tc偷回来
+    IncreaseLimitLocked();
+    if (_maxCachedBytes.load(std::memory_order_relaxed) == 0) {
+        _maxCachedBytes.store(MIN_THREAD_CACHE_SIZE, std::memory_order_relaxed);
+        _unclaimedBudget -= MIN_THREAD_CACHE_SIZE;
+    }
+}
+
+ThreadCache::~ThreadCache() {
+    ReleaseAll();
+
+    std::unique_lock<std::mutex> lock(_allCachesMtx);
+    _unclaimedBudget += _maxCachedBytes.load(std::memory_order_relaxed);
+    if (_nextSteal == this) {
+        _nextSteal = _nextCache;
+    }
+    if (_prevCache) {
+        _prevCache->_nextCache = _nextCache;
+    } else {
+        _allCaches = _nextCache;
+    }
+    if (_nextCache) {
+        _nextCache->_prevCache = _prevCache;
+    }
+}
+
+void ThreadCache::InitBudgetLocked() {
+    static bool inited = false;
+    if (inited) {
+        return;
+    }
+    inited = true;
+    const char* env = getenv("MEMPOOL_TC_BUDGET");
+    if (env != nullptr && env[0] != '\0') {
+        size_t bytes = strtoull(env, nullptr, 10);
+        _unclaimedBudget += (ptrdiff_t) bytes - (ptrdiff_t) _overallBudget;
+        _overallBudget = bytes;
+    }
+}
+
+void ThreadCache::SetOverallBudget(size_t bytes) {
+    std::unique_lock<std::mutex> lock(_allCachesMtx);
+    InitBudgetLocked();
+    _unclaimedBudget += (ptrdiff_t) bytes - (ptrdiff_t) _overallBudget;
+    _overallBudget = bytes;
+
+    // 调小之后领超了：从各个tc的上限中收回来，每个tc最多收到MIN_THREAD_CACHE_SIZE
+    for (ThreadCache* tc = _allCaches; tc != nullptr && _unclaimedBudget < 0; tc = tc->_nextCache) {
+        tc->ShrinkLimitLocked();
+    }
+}
+
+void ThreadCache::ShrinkLimitLocked() {
+    size_t maxBytes = _maxCachedBytes.load(std::memory_order_relaxed);
+    if (_unclaimedBudget >= 0 || maxBytes <= MIN_THREAD_CACHE_SIZE) {
+        return;
+    }
+    size_t amount = min((size_t) -_unclaimedBudget, maxBytes - MIN_THREAD_CACHE_SIZE);
+    _unclaimedBudget += amount;
+    _maxCachedBytes.store(maxBytes - amount, std::memory_order_relaxed);
+}
+
+void ThreadCache::IncreaseLimitLocked(size_t step) {
+    size_t maxBytes = _maxCachedBytes.load(std::memory_order_relaxed);
+    if (_unclaimedBudget > 0) {
+        size_t amount = min((size_t) _unclaimedBudget, step);
+        _unclaimedBudget -= amount;
+        _maxCachedBytes.store(maxBytes + amount, std::memory_order_relaxed);
+        return;
+    }
+
+    // 预算已经领完了，从其他tc偷：轮流挑，不总是从同一个tc偷，最多看10个
+    // 被偷的tc上限不会低于MIN_THREAD_CACHE_SIZE；一直在用的tc会在Scavenge时再偷回去，所以上限最终流向忙的线程
+    for (int i = 0; i < 10; ++i) {
+        if (_nextSteal == nullptr) {
+            _nextSteal = _allCaches;
+        }
+        ThreadCache* victim = _nextSteal;
+        _nextSteal = victim->_nextCache;
+        if (victim == this) {
+            continue;
+        }
+        size_t victimMax = victim->_maxCachedBytes.load(std::memory_order_relaxed);
+        if (victimMax <= MIN_THREAD_CACHE_SIZE) {
+            continue;
+        }
+        size_t amount = min(victimMax - MIN_THREAD_CACHE_SIZE, step);
+        victim->_maxCachedBytes.store(victimMax - amount, std::memory_order_relaxed);
+        _maxCachedBytes.store(maxBytes + amount, std::memory_order_relaxed);
+        return;
+    }
+}
+
+void ThreadCache::Scavenge() {
+    // low-water个对象从上次scavenge到现在一直躺在链表里，还回去一半
+    // 用到的对象不动，这样忙的桶不会因为scavenge多跑一趟cc
+    for (size_t i = 0; i < NLISTS; ++i) {
+        FreeList* freelist = &_freelist[i];
+        size_t lowater = freelist->LowWater();
+        if (lowater > 0) {
+            size_t size = SizeClass::ClassSize(i);
+            size_t batch = SizeClass::NumMoveSize(size);
+            ReleaseToCentral(freelist, lowater > 1 ? lowater / 2 : 1, size);
+            // 这个桶缓存得太多了，MaxSize也收回一批
+            if (freelist->MaxSize() > batch) {
+                freelist->MaxSize() = max(freelist->MaxSize() - batch, batch);
+            }
+        }
+        freelist->ClearLowWater();
+    }
+
+    // 总预算领超了：缩小自己的上限，而不是再去偷别的tc
+    // 否则本线程一直在释放内存，说明它在忙，隔几次扩大一点上限
+    bool overdrawn = _unclaimedBudget.load(std::memory_order_relaxed) < 0;
+    if (overdrawn || ++_scavenges % SCAVENGES_PER_LIMIT_CHANGE == 0) {
+        std::unique_lock<std::mutex> lock(_allCachesMtx);
+        if (_unclaimedBudget < 0) {
+            ShrinkLimitLocked();
+        } else {
+            IncreaseLimitLocked(SCAVENGES_PER_LIMIT_CHANGE * THREAD_CACHE_STEAL);
+        }
+    }
+
+    size_t maxBytes = _maxCachedBytes.load(std::memory_order_relaxed);
+    if (_cachedBytes > maxBytes) {
+        size_t target = maxBytes - maxBytes / 8;
+        while (_cachedBytes > target) {
+            ReleaseLargestList();
+        }
+    }
+}
+
+void ThreadCache::ReleaseLargestList() {
+    size_t largest = 0;
+    size_t largestBytes = 0;
+    for (size_t i = 0; i < NLISTS; ++i) {
+        size_t bytes = _freelist[i].Size() * SizeClass::ClassSize(i);
+        if (bytes > largestBytes) {
+            largest = i;
+            largestBytes = bytes;
+        }
+    }
+    assert (largestBytes > 0);
+    FreeList* freelist = &_freelist[largest];
+    size_t size = SizeClass::ClassSize(largest);
+    ReleaseToCentral(freelist, min(SizeClass::NumMoveSize(size), freelist->Size()), size);
+}
+
+void ThreadCache::GetStats(MemoryPoolStats& stats) {
+    std::unique_lock<std::mutex> lock(_allCachesMtx);
+    stats._threadCacheBudget = _overallBudget;
+    for (ThreadCache* tc = _allCaches; tc != nullptr; tc = tc->_nextCache) {
+        ++stats._threadCaches;
+        stats._threadCacheLimit += tc->_maxCachedBytes.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < NLISTS; ++i) {
+            stats._sizeClasses[i]._threadCacheObjs += tc->_freelist[i].Size();
+        }
+    }
+}
+
 // tc申请内存
 void *
 ThreadCache::Allocate(size_t size) {
@@ -11,6 +186,7 @@ ThreadCache::Allocate(size_t size) {
 
     // 自由链表不为空: 直接取
     if (!freelist->Empty()) {
+        _cachedBytes -= SizeClass::ClassSize(index);
         return freelist->Pop();
     }
         // 自由链表为空：去中心缓存中拿取内存对象，一次取多个防止多次去取而加锁带来的开销
@@ -34,20 +210,32 @@ ThreadCache::Deallocate(void *ptr, size_t size) {
 
     // 直接释放
     freelist->Push(ptr);
+    size = SizeClass::ClassSize(index);
+    _cachedBytes += size;
 
     // 满足条件（批量释放）时，释放回中心内存
-    if (freelist->Size() >= freelist->MaxSize()) {
+    if (freelist->Size() > freelist->MaxSize()) {
         ListTooLong(freelist, size);
     }
+    // 整个tc超过了缓存上限
+    if (_cachedBytes > _maxCachedBytes.load(std::memory_order_relaxed)) {
+        Scavenge();
+    }
 }
 
 // tc从cc获取对象
 void *
 ThreadCache::FetchFromCentralCache(size_t index, size_t size) {
     // 通过MaxSize和NumMoveSize来控制每次从中心缓存获取的内存对象个数
-    size_t batchNum = min(_freelist[index].MaxSize(), SizeClass::NumMoveSize(size));
-    if (batchNum == _freelist[index].MaxSize()) {
-        _freelist[index].MaxSize()++;
+    // 链表空了说明MaxSize不够用：不到一批时慢启动每次加1，之后每次加一批，最多MAX_FREELIST_LENGTH个
+    FreeList &freelist = _freelist[index];
+    size_t batch = SizeClass::NumMoveSize(size);
+    size_t batchNum = min(freelist.MaxSize(), batch);
+    if (freelist.MaxSize() < batch) {
+        ++freelist.MaxSize();
+    } else {
+        size_t maxsize = min(freelist.MaxSize() + batch, MAX_FREELIST_LENGTH);
+        freelist.MaxSize() = maxsize - maxsize % batch;
     }
 
     // 输出型参数，返回之后的结果是tc想要的空间
@@ -67,14 +255,55 @@ ThreadCache::FetchFromCentralCache(size_t index, size_t size) {
     } else {
         // start返回给线程，其他插入tc的链表
         _freelist[index].PushRange(NEXT_OBJ(start), end, actualNum - 1);
+        _cachedBytes += (actualNum - 1) * size;
         return start;
     }
 }
 
 // tc释放对象链表过长时，回收到tc
 void ThreadCache::ListTooLong(FreeList *freelist, size_t size) {
-    void *start = nullptr;
-    void *end = nullptr;
-    freelist->PopRange(start, end, freelist->MaxSize());
-    CentralCache::GetInstance()->ReleaseListToSpans(start, size);
-}
\ No newline at end of file
+    // 只还一批，剩下的留着给接下来的申请用，避免在MaxSize附近来回申请释放时每次都去cc
+    size_t batch = SizeClass::NumMoveSize(size);
+    ReleaseToCentral(freelist, min(batch, freelist->Size()), size);
+
+    if (freelist->MaxSize() < batch) {
+        // 慢启动阶段：链表溢出说明释放得多，MaxSize继续加1
+        ++freelist->MaxSize();
+    } else if (freelist->MaxSize() > batch) {
+        // 多次溢出说明MaxSize太大了，缓存的对象用不上，减少一批
+        if (++freelist->Overages() > MAX_OVERAGES) {
+            freelist->MaxSize() -= batch;
+            freelist->Overages() = 0;
+        }
+    }
+}
+
+void ThreadCache::ReleaseToCentral(FreeList *freelist, size_t n, size_t size) {
+    _cachedBytes -= n * size;
+    // 按一批一批还给cc，cc可以整批放进transfer cache
+    size_t batch = SizeClass::NumMoveSize(size);
+    while (n > 0) {
+        size_t count = min(n, batch);
+        void *start = nullptr;
+        void *end = nullptr;
+        freelist->PopRange(start, end, count);
+        CentralCache::GetInstance()->ReleaseRange(start, end, count, size);
+        n -= count;
+    }
+}
+
+// 把tc中所有的对象还给cc，cc中use count归零的span会继续还给pc合并
+void ThreadCache::ReleaseAll() {
+    for (size_t i = 0; i < NLISTS; ++i) {
+        FreeList *freelist = &_freelist[i];
+        if (freelist->Empty()) {
+            continue;
+        }
+        void *start = nullptr;
+        void *end = nullptr;
+        freelist->PopRange(start, end, freelist->Size());
+        size_t size = SizeClass::ClassSize(i);
+        CentralCache::GetInstance()->ReleaseListToSpans(start, size);
+    }
+    _cachedBytes = 0;
+}
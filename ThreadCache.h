@@ -2,29 +2,73 @@
 #define CPPPROJECT_THREADCACHE_H
 
 #include "common.h"
+#include "MemoryStats.h"
 
 class ThreadCache {
 
 private:
     FreeList _freelist[NLISTS];   //tc自由链表
 
+    // 所有存活的tc串成一个双向链表，统计和互相偷缓存上限时遍历
+    ThreadCache* _prevCache = nullptr;
+    ThreadCache* _nextCache = nullptr;
+    static ThreadCache* _allCaches;
+    static std::mutex _allCachesMtx;
+
+    // 所有tc共享一个总预算（字节），每个tc从中领一份缓存上限
+    // 领不到时按轮转从其他tc那里偷，被偷的tc下次释放内存时发现超过上限，自己把多余的还给cc
+    size_t _cachedBytes = 0;                    // 本tc缓存的字节数，只有所属线程会改
+    std::atomic<size_t> _maxCachedBytes{0};     // 本tc的缓存上限，在_allCachesMtx内修改
+    static size_t _overallBudget;               // 总预算
+    // 总预算中还没被领走的部分，调小总预算后可能为负；在_allCachesMtx内修改，Scavenge不加锁先读一下
+    static std::atomic<ptrdiff_t> _unclaimedBudget;
+    static ThreadCache* _nextSteal;             // 下一个被偷的tc
+
+    // 预算没有领超时，每这么多次Scavenge才加一次全局锁扩大上限（一次扩大这么多倍），
+    // 避免超过上限的线程每次释放都抢_allCachesMtx
+    static const size_t SCAVENGES_PER_LIMIT_CHANGE = 8;
+    size_t _scavenges = 0;                      // Scavenge的次数，只有所属线程会改
+
+    // 第一次使用时读取环境变量 MEMPOOL_TC_BUDGET（字节数）
+    static void InitBudgetLocked();
+    // 扩大本tc的缓存上限（最多step字节）：先从总预算里领，领不到就从其他tc偷
+    void IncreaseLimitLocked(size_t step = THREAD_CACHE_STEAL);
+    // 总预算被调小、已经领超了时，缩小本tc的缓存上限还给总预算，不低于MIN_THREAD_CACHE_SIZE
+    void ShrinkLimitLocked();
+    // 缓存超过上限时，每个桶还回上次scavenge以来一直没用到的对象的一半，然后调整上限
+    // 还是超过上限时（比如只释放不申请的线程，low-water一直是链表长度，第一轮为0），
+    // 从缓存字节数最多的桶开始一批一批地还，直到比上限低1/8，避免接下来每次释放都进来
+    void Scavenge();
+    // 把缓存字节数最多的桶还回一批
+    void ReleaseLargestList();
+    // 从freelist中拿出n个size大小的对象，按一批一批还给cc
+    void ReleaseToCentral(FreeList* freelist, size_t n, size_t size);
+
 public:
+    ThreadCache();
+    // 线程退出回收tc时，把所有自由链表中的对象还给cc
+    ~ThreadCache();
+
     //申请和释放size大小对象
     void* Allocate(size_t size);
+    // size可以是申请时的大小，也可以是对齐后的大小，两者落在同一个桶里
     void Deallocate(void* ptr, size_t size);
 
     //从中心缓存获取对象
     void* FetchFromCentralCache(size_t index, size_t size);
-    //释放对象时，链表过长时，回收内存回到中心堆
+    //释放对象时，链表过长时，回收一批内存回到中心堆，并根据溢出的次数调整MaxSize
     void ListTooLong(FreeList* list, size_t size);
+    //把所有自由链表中的对象都还给中心缓存
+    void ReleaseAll();
 
-};
+    // 汇总所有tc中各个桶缓存的内存块数
+    static void GetStats(MemoryPoolStats& stats);
 
-// 静态TLS
-// _declspec (thread)是windows方法
-// static _declspec(thread) ThreadCache* pTLSThreadCache = nullptr; // ==> _declspec(thread)是Windows特有的，不是所有编译器都支持
-// _declspec (thread) static ThreadCache* tlslist = nullptr;
-static thread_local ThreadCache* pTLSThreadCache = nullptr;      // thread_local是C++11提供的，能跨平台
+    // 设置所有tc一共最多缓存的字节数
+    // 调小时立即按轮转缩小已有tc的上限（不低于MIN_THREAD_CACHE_SIZE），各tc下次释放内存时把超出的部分还给cc
+    static void SetOverallBudget(size_t bytes);
+
+};
 
 #endif //CPPPROJECT_THREADCACHE_H
 
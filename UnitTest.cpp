@@ -1,5 +1,10 @@
 #include "ConcurrentAlloc.h"
+#include "Arena.h"
+#include "PoolAllocator.h"
 #include<pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <map>
 
 // 线程1执行方法
 void Alloc1() {
@@ -122,6 +127,518 @@ void BigAlloc()
     ConcurrentFree(p2);
 }
 
+void TestStats()
+{
+    std::vector<void*> v;
+    for (size_t i = 0; i < 1000; ++i)
+    {
+        v.push_back(ConcurrentAlloc(24));
+    }
+
+#ifdef MEMPOOL_CHECKED
+    // 检查模式下每块内存多了canary，落在更大的桶里
+    const size_t objsize = 24 + MemoryChecker::CANARY_BYTES;
+#else
+    const size_t objsize = 24;
+#endif
+    MemoryPoolStats stats = GetStats();
+    SizeClassStats& sc = stats._sizeClasses[SizeClass::Index(objsize)];
+    assert (sc._objsize == objsize);
+    assert (sc._appObjs == 1000);
+    cout << "tc: " << sc._threadCacheObjs << " cc free: " << sc._centralFreeObjs
+         << " spans: " << sc._centralSpans << " mapped: " << stats._pageCache._mappedBytes << endl;
+
+    for (auto e : v)
+    {
+        ConcurrentFree(e);
+    }
+    stats = GetStats();
+    assert (stats._sizeClasses[SizeClass::Index(objsize)]._appObjs == 0);
+}
+
+void TestReleaseFreeMemory()
+{
+    void* p = ConcurrentAlloc(600 * 1024);
+    ConcurrentFree(p);
+
+    size_t released = ReleaseFreeMemory();
+    cout << "released: " << released << endl;
+    assert (released > 0);
+
+    // 还给系统的页可以再次使用
+    p = ConcurrentAlloc(600 * 1024);
+    memset(p, 0, 600 * 1024);
+    ConcurrentFree(p);
+}
+
+void TestAlignedAlloc()
+{
+    // 小块对齐走桶，超过一页的对齐走pc
+    size_t aligns[] = {16, 32, 64, 4096, 8192, 64 * 1024, 2 * 1024 * 1024};
+    size_t sizes[] = {1, 24, 100, 3000, 70 * 1024, 300 * 1024};
+    for (size_t align : aligns) {
+        for (size_t size : sizes) {
+            void* p = ConcurrentAllocAligned(size, align);
+            assert (((size_t) p & (align - 1)) == 0);
+            memset(p, 0, size);
+            ConcurrentFree(p);
+        }
+    }
+    cout << "aligned alloc ok" << endl;
+}
+
+void TestRealloc()
+{
+    // 同一个桶内原地返回（检查模式下realloc总是搬家，不检查原地）
+    char* p = (char*) ConcurrentRealloc(nullptr, 100);
+    memset(p, 'a', 100);
+    char* q = (char*) ConcurrentRealloc(p, SizeClass::RoundUp(100));
+#ifndef MEMPOOL_CHECKED
+    assert (q == p);
+#endif
+    p = q;
+
+    // 缩小到别的桶时换桶，之后可以按新的size带大小回收
+    char* small = (char*) ConcurrentRealloc(nullptr, 1000);
+    memset(small, 'b', 1000);
+    char* shrunk = (char*) ConcurrentRealloc(small, 600);
+    assert (shrunk != small && shrunk[599] == 'b');
+    ConcurrentFree(shrunk, 600);
+
+    // 换桶时拷贝原来的内容
+    q = (char*) ConcurrentRealloc(p, 5000);
+    assert (q[0] == 'a' && q[99] == 'a');
+
+    // 大块内存不断变大，右边有空闲页时原地扩大
+    char* big = (char*) ConcurrentRealloc(q, 300 * 1024);
+    assert (big[99] == 'a');
+    size_t inplace = 0;
+    for (size_t size = 300 * 1024; size <= 1000 * 1024; size += 64 * 1024) {
+        char* nbig = (char*) ConcurrentRealloc(big, size);
+        inplace += nbig == big;
+        assert (nbig[0] == 'a');
+        big = nbig;
+    }
+    cout << "realloc in place: " << inplace << endl;
+    assert (ConcurrentRealloc(big, 0) == nullptr);
+}
+
+void TestCalloc()
+{
+    // 用过的页还回pc后再calloc，必须重新清0
+    const size_t size = 600 * 1024;
+    for (int i = 0; i < 3; ++i) {
+        char* p = (char*) ConcurrentCalloc(size, 1);
+        for (size_t j = 0; j < size; j += 512) {
+            assert (p[j] == 0);
+        }
+        memset(p, 0xff, size);
+        ConcurrentFree(p);
+        if (i == 1) {
+            ReleaseFreeMemory();
+        }
+    }
+
+    int* q = (int*) ConcurrentCalloc(10, sizeof(int));
+    for (int j = 0; j < 10; ++j) {
+        assert (q[j] == 0);
+    }
+    ConcurrentFree(q);
+    cout << "calloc ok" << endl;
+}
+
+void TestThreadCacheBudget()
+{
+    const size_t budget = 4 << 20;
+    const size_t n = 16;
+    SetThreadCacheBudget(budget);
+
+    // 所有线程都释放完之后再统计，统计完才退出
+    std::atomic<size_t> done{0};
+    std::atomic<bool> quit{false};
+    std::vector<std::thread> vthread;
+    for (size_t k = 0; k < n; ++k)
+    {
+        vthread.emplace_back([&, k]() {
+            std::vector<void*> v;
+            for (size_t round = 0; round < 10; ++round)
+            {
+                for (size_t i = 0; i < 1000; ++i)
+                {
+                    v.push_back(ConcurrentAlloc((i * 97 + k * 31) % 20000 + 1));
+                }
+                for (auto e : v)
+                {
+                    ConcurrentFree(e);
+                }
+                v.clear();
+            }
+            ++done;
+            while (!quit)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+    while (done < n)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    MemoryPoolStats stats = GetStats();
+    size_t cached = 0;
+    for (size_t i = 0; i < NLISTS; ++i)
+    {
+        cached += stats._sizeClasses[i]._threadCacheObjs * stats._sizeClasses[i]._objsize;
+    }
+    cout << "tc cached: " << cached << " limit: " << stats._threadCacheLimit << endl;
+    assert (stats._threadCacheBudget == budget);
+    // 预算不够时每个tc也至少能有MIN_THREAD_CACHE_SIZE
+    assert (stats._threadCacheLimit <= budget + n * MIN_THREAD_CACHE_SIZE);
+    // 每个tc缓存的都不超过自己的上限
+    assert (cached <= stats._threadCacheLimit);
+
+    quit = true;
+    for (auto& t : vthread)
+    {
+        t.join();
+    }
+    SetThreadCacheBudget(THREAD_CACHE_BUDGET);
+}
+
+struct TreeNode
+{
+    int _val = 1;
+    TreeNode* _left = nullptr;
+    TreeNode* _right = nullptr;
+};
+
+void TestThreadCachedObjectPool()
+{
+    static ThreadCachedObjectPool<TreeNode> pool;
+    const size_t n = 4;
+    std::vector<std::thread> vthread;
+    for (size_t k = 0; k < n; ++k)
+    {
+        vthread.emplace_back([&, k]() {
+            std::vector<TreeNode*> v;
+            for (size_t round = 0; round < 100; ++round)
+            {
+                for (size_t i = 0; i < 1000 + k * 37; ++i)
+                {
+                    TreeNode* node = pool.New();
+                    assert (node->_val == 1 && node->_left == nullptr);
+                    node->_val = (int) k;
+                    v.push_back(node);
+                }
+                for (auto e : v)
+                {
+                    assert (e->_val == (int) k);
+                    pool.Delete(e);
+                }
+                v.clear();
+            }
+        });
+    }
+    for (auto& t : vthread)
+    {
+        t.join();
+    }
+
+    // 在别的线程释放：对象进入本线程的弹匣，之后照常复用
+    TreeNode* node = pool.New();
+    std::thread([&]() { pool.Delete(node); }).join();
+    node = pool.New();
+    pool.Delete(node);
+    cout << "thread cached object pool ok" << endl;
+}
+
+void TestPoolAllocator()
+{
+    std::vector<int, PoolAllocator<int>> v;
+    for (int i = 0; i < 100000; ++i)
+    {
+        v.push_back(i);
+    }
+    assert (v[99999] == 99999);
+
+    // map内部把分配器rebind到节点类型
+    std::map<int, std::string, std::less<int>, PoolAllocator<std::pair<const int, std::string>>> m;
+    for (int i = 0; i < 1000; ++i)
+    {
+        m[i] = std::to_string(i);
+    }
+    auto m2 = m;
+    m.swap(m2);
+    assert (m.size() == 1000 && m[10] == "10");
+
+    // 对齐要求高于8字节的类型
+    struct alignas(64) Line
+    {
+        char _data[64];
+    };
+    std::vector<Line, PoolAllocator<Line>> lines(10);
+    assert (((size_t) lines.data() & 63) == 0);
+    cout << "pool allocator ok" << endl;
+}
+
+void TestArena()
+{
+    Arena arena;
+    for (int round = 0; round < 3; ++round)
+    {
+        std::vector<int*> v;
+        for (int i = 0; i < 100000; ++i)
+        {
+            int* p = (int*) arena.Allocate(sizeof(int) * (i % 7 + 1));
+            *p = i;
+            v.push_back(p);
+        }
+        double* d = (double*) arena.Allocate(sizeof(double), 64);
+        assert (((size_t) d & 63) == 0);
+        // 超过一个span的申请
+        char* big = (char*) arena.Allocate(200 * 1024);
+        memset(big, 0, 200 * 1024);
+        for (int i = 0; i < 100000; ++i)
+        {
+            assert (*v[i] == i);
+        }
+        cout << "arena spans: " << arena.SpanCount() << " bytes: " << arena.BytesAllocated() << endl;
+        arena.Reset();
+        assert (arena.SpanCount() == 0);
+    }
+}
+
+static void* ProfiledAlloc(size_t size)
+{
+    return ConcurrentAlloc(size);
+}
+
+void TestHeapProfiler()
+{
+    HeapProfiler::SetSampleRate(64 * 1024);
+    std::vector<void*> v;
+    for (int i = 0; i < 10000; ++i)
+    {
+        v.push_back(ProfiledAlloc(1000));
+    }
+    size_t live = HeapProfiler::LiveSamples();
+    cout << "live samples: " << live << endl;
+    assert (live > 0);
+
+    assert (HeapProfiler::Dump("/tmp/mempool.folded", HeapProfiler::FOLDED));
+    assert (HeapProfiler::Dump("/tmp/mempool.heap", HeapProfiler::PPROF));
+
+    for (auto e : v)
+    {
+        ConcurrentFree(e);
+    }
+    assert (HeapProfiler::LiveSamples() == 0);
+    HeapProfiler::SetSampleRate(0);
+}
+
+#ifdef MEMPOOL_CHECKED
+#include <sys/wait.h>
+
+// 在子进程中执行fn，返回子进程是否被abort
+static bool AbortsInChild(void (*fn)())
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        fn();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    return WIFSIGNALED(status) && WTERMSIG(status) == SIGABRT;
+}
+
+void TestCheckedMode()
+{
+    // 正常的申请释放不报错
+    char* p = (char*)ConcurrentAlloc(20);
+    memset(p, 1, 20);
+    p = (char*)ConcurrentRealloc(p, 100);
+    ConcurrentFree(p, 100);
+
+    assert (AbortsInChild([] { void* q = ConcurrentAlloc(32); ConcurrentFree(q); ConcurrentFree(q); }));
+    assert (AbortsInChild([] { void* q = ConcurrentAlloc(300 * 1024); ConcurrentFree(q); ConcurrentFree(q); }));
+    assert (AbortsInChild([] { void* q = ConcurrentAlloc(64); ConcurrentFree(q, 128); }));
+    assert (AbortsInChild([] { char* q = (char*)ConcurrentAlloc(20); q[20] = 0; ConcurrentFree(q); }));
+    assert (AbortsInChild([] { char* q = (char*)ConcurrentAlloc(64); ConcurrentFree(q + 16); }));
+    cout << "checked mode ok" << endl;
+}
+#endif
+
+void TestLargeSpanCache()
+{
+    // MEMPOOL_LARGE_CACHE调小或者关掉缓存时，4M的内存块不会被缓存，跳过
+    size_t budget = LARGE_CACHE_BUDGET;
+    const char* env = getenv("MEMPOOL_LARGE_CACHE");
+    if (env != nullptr && env[0] != '\0')
+    {
+        budget = strtoull(env, nullptr, 10);
+    }
+    if (budget < 4 * 1024 * 1024)
+    {
+        cout << "large span cache disabled, skip" << endl;
+        return;
+    }
+
+    // 还回来的大块内存留在缓存中，同样大小的申请直接复用，不再mmap
+    void* p1 = ConcurrentAlloc(4 * 1024 * 1024);
+    ConcurrentFree(p1);
+    size_t mapped = GetStats()._pageCache._mappedBytes;
+    void* p2 = ConcurrentAlloc(4 * 1024 * 1024);
+    assert (p2 == p1);
+    assert (GetStats()._pageCache._mappedBytes == mapped);
+    ConcurrentFree(p2);
+
+    // 缓存有上限，超过的部分munmap掉
+    std::vector<void*> v;
+    for (size_t i = 1; i <= 16; ++i)
+    {
+        v.push_back(ConcurrentAlloc(i * 1024 * 1024));
+    }
+    for (auto e : v)
+    {
+        ConcurrentFree(e);
+    }
+    PageCacheStats stats = GetStats()._pageCache;
+    assert (stats._largeSpanBytes == 0);
+    assert (stats._largeCachedBytes <= budget);
+
+    ReleaseFreeMemory();
+    assert (GetStats()._pageCache._largeCachedBytes == 0);
+    cout << "large span cache ok, mapped: " << stats._mappedBytes << endl;
+}
+
+void TestReleaseTransferCache()
+{
+    // 一个线程释放大量内存块，链表太长时一批一批还给cc，进入transfer cache
+    std::thread t([]() {
+        std::vector<void*> v;
+        for (size_t i = 0; i < 10000; ++i) {
+            v.push_back(ConcurrentAlloc(64));
+        }
+        for (void* p : v) {
+            ConcurrentFree(p);
+        }
+    });
+    t.join();
+#ifdef MEMPOOL_CHECKED
+    // 检查模式下每块内存多了canary，落在更大的桶里
+    size_t index = SizeClass::Index(64 + MemoryChecker::CANARY_BYTES);
+#else
+    size_t index = SizeClass::Index(64);
+#endif
+    MemoryPoolStats stats = GetStats();
+    cout << "transfer objs: " << stats._sizeClasses[index]._transferObjs << endl;
+    assert (stats._sizeClasses[index]._transferObjs > 0);
+
+    // ReleaseFreeMemory之后transfer cache清空
+    ReleaseFreeMemory();
+    stats = GetStats();
+    for (size_t i = 0; i < NLISTS; ++i) {
+        assert (stats._sizeClasses[i]._transferObjs == 0);
+    }
+}
+
+// 把当前线程绑到允许运行的CPU中的第i个（轮转），返回是否绑定成功
+static bool PinToCpu(const std::vector<int>& cpus, size_t i)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpus[i % cpus.size()], &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+void TestCpuCache()
+{
+    // 本进程允许运行的CPU
+    std::vector<int> cpus;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int c = 0; c < CPU_SETSIZE; ++c)
+    {
+        if (CPU_ISSET(c, &allowed))
+        {
+            cpus.push_back(c);
+        }
+    }
+
+#ifdef MEMPOOL_CHECKED
+    // 检查模式下每块内存多了canary，落在更大的桶里
+    const size_t index = SizeClass::Index(200 + MemoryChecker::CANARY_BYTES);
+#else
+    const size_t index = SizeClass::Index(200);
+#endif
+    size_t baseApp = GetStats()._sizeClasses[index]._appObjs;
+
+    SetCpuCacheEnabled(true);
+    // 线程数多于CPU数，同一个CPU的slot会被多个线程抢，覆盖自旋锁
+    const size_t nthread = 8;
+    const size_t count = 2000;
+    std::vector<std::vector<char*>> blocks(nthread);
+
+    // 第一轮：线程i绑在第i个CPU上申请
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nthread; ++i)
+    {
+        threads.emplace_back([&, i]() {
+            PinToCpu(cpus, i);
+            for (size_t j = 0; j < count; ++j)
+            {
+                char* p = (char*) ConcurrentAlloc(200);
+                memset(p, (int) i, 200);
+                blocks[i].push_back(p);
+            }
+        });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+    threads.clear();
+
+    MemoryPoolStats stats = GetStats();
+    assert (stats._sizeClasses[index]._appObjs == baseApp + nthread * count);
+    // 每个CPU一个slot，slot中的tc也计入tc个数
+    assert (stats._threadCaches >= (size_t) sysconf(_SC_NPROCESSORS_CONF));
+
+    // 第二轮：线程i释放线程i+1申请的内存块，释放到一半时换到另一个CPU上
+    for (size_t i = 0; i < nthread; ++i)
+    {
+        threads.emplace_back([&, i]() {
+            size_t owner = (i + 1) % nthread;
+            PinToCpu(cpus, i);
+            for (size_t j = 0; j < count; ++j)
+            {
+                if (j == count / 2 && PinToCpu(cpus, i + 1) && cpus.size() > 1)
+                {
+                    assert (CpuCache::CurrentCpu() == (size_t) cpus[(i + 1) % cpus.size()]);
+                }
+                char* p = blocks[owner][j];
+                assert (p[0] == (char) owner && p[199] == (char) owner);
+                ConcurrentFree(p);
+            }
+        });
+    }
+    for (auto& t : threads)
+    {
+        t.join();
+    }
+
+    stats = GetStats();
+    assert (stats._sizeClasses[index]._appObjs == baseApp);
+    assert (stats._sizeClasses[index]._threadCacheObjs > 0);
+    cout << "cpu cache: " << cpus.size() << " cpus, tc: " << stats._threadCaches
+         << " cached: " << stats._sizeClasses[index]._threadCacheObjs << endl;
+    SetCpuCacheEnabled(false);
+}
+
 
 // 简单测试
 //int main() {
@@ -131,5 +648,19 @@ void BigAlloc()
 //    TestConcurrentFree1();
 //    // TestMultiThread();
 //    // BigAlloc();
+//    // TestStats();
+//    // TestReleaseFreeMemory();
+//    // TestAlignedAlloc();
+//    // TestRealloc();
+//    // TestCalloc();
+//    // TestThreadCacheBudget();
+//    // TestThreadCachedObjectPool();
+//    // TestPoolAllocator();
+//    // TestArena();
+//    // TestHeapProfiler();
+//    // TestCheckedMode();
+//    // TestLargeSpanCache();
+//    // TestReleaseTransferCache();
+//    // TestCpuCache();
 //    return 0;
 //}
\ No newline at end of file
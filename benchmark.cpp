@@ -51,13 +51,13 @@ void BenchmarkMalloc(size_t ntimes, size_t nworks, size_t rounds)
         t.join();
     }
 
-    printf("%u个线程并发执行%u轮次，每轮次malloc %u次: 花费：%u ms\n",
+    printf("%zu个线程并发执行%zu轮次，每轮次malloc %zu次: 花费：%zu ms\n",
            nworks, rounds, ntimes, malloc_costtime.load());
 
-    printf("%u个线程并发执行%u轮次，每轮次free %u次: 花费：%u ms\n",
+    printf("%zu个线程并发执行%zu轮次，每轮次free %zu次: 花费：%zu ms\n",
            nworks, rounds, ntimes, free_costtime.load());
 
-    printf("%u个线程并发malloc&free %u次，总计花费：%u ms\n",
+    printf("%zu个线程并发malloc&free %zu次，总计花费：%zu ms\n",
            nworks, nworks * rounds * ntimes, malloc_costtime.load() + free_costtime.load());
 }
 
@@ -104,13 +104,64 @@ void BenchmarkConcurrentMalloc(size_t ntimes, size_t nworks, size_t rounds)
         t.join();
     }
 
-    printf("%u个线程并发执行%u轮次，每轮次concurrent alloc %u次: 花费：%u ms\n",
+    printf("%zu个线程并发执行%zu轮次，每轮次concurrent alloc %zu次: 花费：%zu ms\n",
            nworks, rounds, ntimes, malloc_costtime.load());
 
-    printf("%u个线程并发执行%u轮次，每轮次concurrent dealloc %u次: 花费：%u ms\n",
+    printf("%zu个线程并发执行%zu轮次，每轮次concurrent dealloc %zu次: 花费：%zu ms\n",
            nworks, rounds, ntimes, free_costtime.load());
 
-    printf("%u个线程并发concurrent alloc&dealloc %u次，总计花费：%u ms\n",
+    printf("%zu个线程并发concurrent alloc&dealloc %zu次，总计花费：%zu ms\n",
+           nworks, nworks * rounds * ntimes, malloc_costtime.load() + free_costtime.load());
+}
+
+// 和BenchmarkConcurrentMalloc一样，只是释放时把size带上，走不查span的sized free
+void BenchmarkConcurrentMallocSized(size_t ntimes, size_t nworks, size_t rounds)
+{
+    std::vector<std::thread> vthread(nworks);
+    std::atomic<size_t> malloc_costtime = {0};
+    std::atomic<size_t> free_costtime = {0};
+
+    for (size_t k = 0; k < nworks; ++k)
+    {
+        vthread[k] = std::thread([&]() {
+            std::vector<void*> v;
+            v.reserve(ntimes);
+
+            for (size_t j = 0; j < rounds; ++j)
+            {
+                size_t begin1 = clock();
+                for (size_t i = 0; i < ntimes; i++)
+                {
+                    v.push_back(ConcurrentAlloc((16 + i) % 8192 + 1));
+                }
+                size_t end1 = clock();
+
+                size_t begin2 = clock();
+                for (size_t i = 0; i < ntimes; i++)
+                {
+                    ConcurrentFree(v[i], (16 + i) % 8192 + 1);
+                }
+                size_t end2 = clock();
+                v.clear();
+
+                malloc_costtime += (end1 - begin1);
+                free_costtime += (end2 - begin2);
+            }
+        });
+    }
+
+    for (auto& t : vthread)
+    {
+        t.join();
+    }
+
+    printf("%zu个线程并发执行%zu轮次，每轮次concurrent alloc %zu次: 花费：%zu ms\n",
+           nworks, rounds, ntimes, malloc_costtime.load());
+
+    printf("%zu个线程并发执行%zu轮次，每轮次sized concurrent dealloc %zu次: 花费：%zu ms\n",
+           nworks, rounds, ntimes, free_costtime.load());
+
+    printf("%zu个线程并发concurrent alloc&sized dealloc %zu次，总计花费：%zu ms\n",
            nworks, nworks * rounds * ntimes, malloc_costtime.load() + free_costtime.load());
 }
 
@@ -122,9 +173,13 @@ int main()
     BenchmarkConcurrentMalloc(n, 4, 10);
     cout << endl << endl;
 
-//    // 这里表示4个线程，每个线程申请10万次，总共申请40万次
-//    BenchmarkMalloc(n, 4, 10);
-//    cout << "==========================================================" << endl;
+    // 同样的负载，释放时带上size
+    BenchmarkConcurrentMallocSized(n, 4, 10);
+    cout << endl << endl;
+
+    // 这里表示4个线程，每个线程申请10万次，总共申请40万次
+    BenchmarkMalloc(n, 4, 10);
+    cout << "==========================================================" << endl;
 
     return 0;
 }
@@ -10,24 +10,36 @@
 #include <stdlib.h>
 #include <algorithm>
 #include <assert.h>
-#include "ObjectPool.h"
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
 
 using std::cout;
 using std::endl;
 using std::min;
+using std::max;
 
 //  size范围                   对齐数          对应哈希桶下标范围
 //  [0, 128]                  8B对齐          freelist[0, 16)        8B内存块16个，对应freelist[0], ... , freelist[15]
 //  [129, 1024]               16B对齐         freelist[16, 72)       16B内存块56个，对应freelist[16], ... , freelist[71]
-//  [1025, 8*1024]            32B对齐         freelist[72, 128)      32B内存块56个，对应freelist[72], ... , freelist[127]
-//  [8*1024+1, 64*1024]       64B对齐         freelist[128, 184)     64B内存块56个，对应freelist[128], ... , freelist[183]
-//  [64*1024+1, 256*1024]     128B对齐        freelist[184, 208)     128B内存块24个，对应freelist[184], ... , freelist[207]
-//  空间浪费率在10%左右
+//  [1025, 8*1024]            128B对齐        freelist[72, 128)      128B对齐的内存块56个，对应freelist[72], ... , freelist[127]
+//  [8*1024+1, 64*1024]       1KB对齐         freelist[128, 184)     1KB对齐的内存块56个，对应freelist[128], ... , freelist[183]
+//  [64*1024+1, 256*1024]     8KB对齐         freelist[184, 208)     8KB对齐的内存块24个，对应freelist[184], ... , freelist[207]
+//  128B以上的空间浪费率不超过12.5%，表由下面的SizeClassTable在编译期生成
 
 static const size_t MAX_BYTES = 256 * 1024; //ThreadCache 申请的最大内存
 static const size_t NLISTS = 208; //数组元素总的有多少个，由对齐规则计算得来
 static const size_t PAGE_SHIFT = 13;
 static const size_t NPAGES = 129;
+static const size_t HUGEPAGE_SHIFT = 21;   // 透明大页2M
+static const size_t HUGEPAGE_NPAGES = (size_t) 1 << (HUGEPAGE_SHIFT - PAGE_SHIFT);   // 一个大页包含的页数
+static const size_t THREAD_CACHE_BUDGET = 32 << 20;        // 所有tc一共最多缓存的字节数（默认）
+static const size_t MIN_THREAD_CACHE_SIZE = MAX_BYTES * 2;  // 单个tc缓存上限的最小值
+static const size_t THREAD_CACHE_STEAL = 64 << 10;          // tc每次扩大缓存上限的字节数
+static const size_t MAX_FREELIST_LENGTH = 8192;             // tc自由链表MaxSize的上限（个数）
+static const size_t MAX_OVERAGES = 3;                       // 自由链表溢出超过这么多次后MaxSize减少一批
+static const size_t CENTRAL_SHARDS = 4;                     // cc每个桶的分片数，每个分片一把锁
+static const size_t LARGE_CACHE_BUDGET = 64 << 20;          // pc最多缓存的超过128页的空闲内存（默认）
 
 // 访问和修改链表的指针
 // 使内存块的开头指向下一个内存块
@@ -39,8 +51,20 @@ static void *&NEXT_OBJ(void *obj) {    //返回类型是对 void* 类型的引
 class FreeList {
 private:
     void *_list = nullptr;  // 链表头指针
-    size_t _size = 0;       // 链表中的内存对象个数
+    // 链表中的内存对象个数，只有所属线程会改
+    // 用relaxed的load/store，和普通变量一样没有额外开销，统计时可以从别的线程读
+    std::atomic<size_t> _size{0};
     size_t _maxsize = 1;    // 链表中最大的内存对象个数
+    size_t _lowater = 0;    // 上次scavenge以来链表长度的最小值，这么多个对象一直没被用到
+    size_t _overages = 0;   // MaxSize超过一批后链表溢出的次数
+
+    void AddSize(size_t n) {
+        _size.store(_size.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    void SubSize(size_t n) {
+        _size.store(_size.load(std::memory_order_relaxed) - n, std::memory_order_relaxed);
+    }
 
 public:
     // 进栈 (释放内存进freelist)
@@ -49,14 +73,14 @@ public:
 
         NEXT_OBJ(obj) = _list;  //   obj -> next = _list
         _list = obj;            //  _list = obj -> next(end)
-        ++_size;
+        AddSize(1);
     }
 
     void PushRange(void *start, void *end, size_t size) {
         NEXT_OBJ(end) = _list;  // start ... end -> next = _list
         _list = start;          // _list = start ... end -> next
 
-        _size += size;          // size个内存块
+        AddSize(size);          // size个内存块
     }
 
     // 出栈 （申请内存出freelist）
@@ -65,19 +89,25 @@ public:
 
         void *obj = _list;      // obj 指向链表头
         _list = NEXT_OBJ(obj);  // 现链表头往前一个
-        --_size;
+        SubSize(1);
+        if (Size() < _lowater) {
+            _lowater = Size();
+        }
         return obj;             // 原链表头取出
     }
 
     void PopRange(void *&start, void *&end, size_t n) {
-        assert (n <= _size);
+        assert (n <= Size());
         start = end = _list;
         for (size_t i = 0; i < n - 1; ++i) {
             end = NEXT_OBJ(end);
         }
         _list = NEXT_OBJ(end);
         NEXT_OBJ(end) = nullptr;
-        _size -= n;
+        SubSize(n);
+        if (Size() < _lowater) {
+            _lowater = Size();
+        }
     }
 
 
@@ -85,28 +115,98 @@ public:
         return _list == nullptr;
     }
 
-    size_t Size() {
-        return _size;
+    size_t Size() const {
+        return _size.load(std::memory_order_relaxed);
     }
 
     size_t &MaxSize() {
         return _maxsize;
     }
+
+    size_t &Overages() {
+        return _overages;
+    }
+
+    size_t LowWater() const {
+        return _lowater;
+    }
+
+    // 开始新一轮的low-water统计
+    void ClearLowWater() {
+        _lowater = Size();
+    }
 };
 
 // 对齐大小的设计（对齐规则）
+// 编译期生成的size class表，Index/RoundUp/NumMoveSize/NumMovePage都只需要查一两次表
+// 对齐规则：
+// [1, 128]            8字节对齐     16个桶
+// (128, 1024]         16字节对齐    56个桶
+// (1K, 8K]            128字节对齐   56个桶
+// (8K, 64K]           1K对齐        56个桶
+// (64K, 256K]         8K对齐        24个桶
+struct SizeClassTable {
+    static const size_t SMALL_MAX = 1024;                   // 1K以内按8字节一格查_smallIndex
+    static const size_t SMALL_SLOTS = SMALL_MAX / 8 + 1;
+    static const size_t LARGE_SLOTS = MAX_BYTES / 128 + 1;  // 1K以上按128字节一格查_largeIndex
+
+    uint8_t _smallIndex[SMALL_SLOTS] = {};  // (size + 7) >> 3 -> 桶下标
+    uint8_t _largeIndex[LARGE_SLOTS] = {};  // (size + 127) >> 7 -> 桶下标
+    uint32_t _size[NLISTS] = {};            // 桶的内存块大小
+    uint16_t _numMoveSize[NLISTS] = {};     // tc和cc之间一次移动的内存块数
+    uint8_t _numMovePage[NLISTS] = {};      // cc一次向pc申请的页数
+
+    constexpr SizeClassTable() {
+        const size_t limits[5] = {128, 1024, 8 * 1024, 64 * 1024, MAX_BYTES};
+        const size_t shifts[5] = {3, 4, 7, 10, 13};
+        size_t index = 0;
+        size_t size = 0;
+        for (int g = 0; g < 5; ++g) {
+            while (size < limits[g]) {
+                size += (size_t) 1 << shifts[g];
+                _size[index] = size;
+
+                // 申请上限算法：最多512个，最少2个
+                size_t num = MAX_BYTES / size;
+                num = num < 2 ? 2 : (num > 512 ? 512 : num);
+                _numMoveSize[index] = num;
+
+                // 块页匹配算法：num个内存块所占的页数，最少1页
+                size_t npage = (num * size) >> PAGE_SHIFT;
+                _numMovePage[index] = npage == 0 ? 1 : npage;
+                ++index;
+            }
+        }
+
+        // 每一格向上找第一个放得下的桶，各组的边界都是格子大小的倍数，同一格内的size落在同一个桶
+        index = 0;
+        for (size_t i = 0; i < SMALL_SLOTS; ++i) {
+            while (_size[index] < (i << 3)) {
+                ++index;
+            }
+            _smallIndex[i] = index;
+        }
+        index = 0;
+        for (size_t i = 0; i < LARGE_SLOTS; ++i) {
+            while (_size[index] < (i << 7)) {
+                ++index;
+            }
+            _largeIndex[i] = index;
+        }
+    }
+};
+
+// inline：所有编译单元共用一份表
+inline constexpr SizeClassTable SIZE_CLASS_TABLE;
+static_assert(SIZE_CLASS_TABLE._size[NLISTS - 1] == MAX_BYTES, "NLISTS与对齐规则不一致");
+
 class SizeClass {
 public:
     // 大佬写法，也可以用%和?:来实现
     // size: 开辟内存块大小
     // align：内存块应该按多少字节对齐，3：按 2的3次方 = 8字节 对齐
-    inline static size_t _Index(size_t size, size_t align) {
-        size_t alignnum = 1 << align;
-        return ((size + alignnum - 1) >> align) - 1;
-    }
-
     inline static size_t _Roundup(size_t size, size_t align) {
-        size_t alignnum = 1 << align;  // 计算对齐的数值，等价于 2^align
+        size_t alignnum = (size_t) 1 << align;  // 计算对齐的数值，等价于 2^align
         return (size + alignnum - 1) & ~(alignnum - 1);
     }
 
@@ -114,66 +214,38 @@ public:
     // 计算对应的自由链表下标（对应哪个哈希桶）
     inline static size_t Index(size_t size) {
         assert (size <= MAX_BYTES);
-        static int group_array[4] = {16, 56, 56, 56};
-        if (size < 128) {
-            return _Index(size, 3);
-        } else if (size < 1024) {
-            return _Index(size - 128, 4) + group_array[0];
-        } else if (size < (8 * 1024)) {
-            return _Index(size - 1024, 7) + group_array[0] + group_array[1];
-        } else if (size < (64 * 1024)) {
-            return _Index(size - 8 * 1024, 10) + group_array[0] + group_array[1] + group_array[2];
-        } else if (size < (256 * 1024)) {
-            return _Index(size - 64 * 1024, 13) + group_array[0] + group_array[1] + group_array[2] + group_array[3];
-        } else {
-            assert (false);
+        if (size <= SizeClassTable::SMALL_MAX) {
+            return SIZE_CLASS_TABLE._smallIndex[(size + 7) >> 3];
         }
-        return -1;
+        return SIZE_CLASS_TABLE._largeIndex[(size + 127) >> 7];
     }
 
     // 计算对齐后的字节数
     inline static size_t RoundUp(size_t bytes) {
-        if (bytes <= 128) {
-            return _Roundup(bytes, 3);
-        } else if (bytes <= 1024) {
-            return _Roundup(bytes, 4);
-        } else if (bytes <= 8 * 1024) {
-            return _Roundup(bytes, 7);
-        } else if (bytes <= 64 * 1024) {
-            return _Roundup(bytes, 10);
-        } else if (bytes <= 256 * 1024) {
-            return _Roundup(bytes, 13);
-        } else {
+        if (bytes > MAX_BYTES) {
             // 单次申请空间超过256k
             return _Roundup(bytes, PAGE_SHIFT);
         }
+        return SIZE_CLASS_TABLE._size[Index(bytes)];
+    }
+
+    // 桶下标对应的内存块大小，Index的逆运算
+    static size_t ClassSize(size_t index) {
+        assert (index < NLISTS);
+        return SIZE_CLASS_TABLE._size[index];
     }
 
     // 申请上限算法：最多512个，最少2个
     static size_t NumMoveSize(size_t size) {
         assert (size > 0);
-
-        int num = MAX_BYTES / size;
-        if (num < 2) {
-            num = 2;
-        }
-        if (num > 512) {
-            num = 512;
-        }
-        return num;
+        return SIZE_CLASS_TABLE._numMoveSize[Index(size)];
     }
 
     // 块页匹配算法（size对应page的数量）
+    // 当cc中没有span为tc提供小块空间时，cc就需要向pc申请一块span，此时需要根据一块空间的大小来匹配
+    // 出一个维护页空间较为合适的span，以保证span为size后尽量不浪费或不足够还再频繁申请相同大小的span
     static size_t NumMovePage(size_t size) {
-        // 当cc中没有span为tc提供小块空间时，cc就需要向pc申请一块span，此时需要根据一块空间的大小来匹配
-        // 出一个维护页空间较为合适的span，以保证span为size后尽量不浪费或不足够还再频繁申请相同大小的span
-        size_t num = NumMoveSize(size);   // cc一次给tc num个内存块
-        size_t npage = num * size;        // 这些内存块所占总空间npage
-        npage >>= PAGE_SHIFT;             // 对应页数npage
-        if (npage == 0) {                 // 最少给1页
-            npage = 1;
-        }
-        return npage;
+        return SIZE_CLASS_TABLE._numMovePage[Index(size)];
     }
 };
 
@@ -194,19 +266,30 @@ struct Span {
 
     size_t _usecount = 0;   // 使用计数(span分配出去的内存块个数)
     bool _isUse = false;    // span是否被使用，false：未被使用，在pc中；true：被使用，在cc中
+
+    uint64_t _freeTime = 0; // 还回pc的时间（毫秒），scavenger据此判断空闲了多久
+    bool _released = false; // 在pc中时，物理页是否已经通过madvise还给系统
+    bool _zeroed = false;   // 内存是否全为0：刚向系统申请的或已经madvise还给系统的页，拿出去用过之后就不是了
+    size_t _shard = 0;      // 在cc中属于桶的哪个分片，切分时确定，还给pc之前不变
+
+#ifdef MEMPOOL_CHECKED
+    std::atomic<uint64_t> *_bitmap = nullptr;  // 检查模式：每个内存块是否在应用程序手里，只有cc中的span有
+#endif
 };
 
 // Span链表，双向循环
 class SpanList {
 private:
+    Span _headNode;  // 哨兵位头节点直接放在对象里，不用new
     Span *_head;   // 哨兵位头节点
     std::mutex _mutex;  // 互斥锁
 
 public:
-    SpanList() {
-        _head = new Span;        // 哨兵位头节点
-        _head->_next = _head;    // 双向循环
-        _head->_prev = _head;
+    // constexpr：全局的SpanList在编译期完成初始化，
+    // 作为malloc替换库时，早于任何构造函数的malloc调用也能用
+    constexpr SpanList() : _headNode(), _head(&_headNode), _mutex() {
+        _headNode._next = &_headNode;    // 双向循环
+        _headNode._prev = &_headNode;
     }
 
 //    ~SpanList() {
@@ -307,26 +390,70 @@ public:
 
 #endif
 
-// 堆上申请空间
-inline static void *SystemAlloc(size_t kpage) {
+// 堆上申请空间，起始地址按align字节对齐
+inline static void *SystemAllocAligned(size_t kpage, size_t align) {
     void *ptr = nullptr;
 #ifdef _WIN32
     ptr = VirtualAlloc(0, kpage << PAGE_SHIFT, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
 #else
-    ptr = mmap(0, kpage << PAGE_SHIFT, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    // mmap只保证4K对齐，多申请align字节再把首尾多出来的部分还回去
+    size_t bytes = kpage << PAGE_SHIFT;
+    char *raw = (char *) mmap(0, bytes + align, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (raw == MAP_FAILED)
+        throw std::bad_alloc();
+    char *aligned = (char *) (((size_t) raw + align - 1) & ~(align - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (raw + bytes + align > aligned + bytes) {
+        munmap(aligned + bytes, raw + bytes + align - (aligned + bytes));
+    }
+    ptr = aligned;
 #endif
     if (ptr == nullptr)
         throw std::bad_alloc();
     return ptr;
 }
 
-// 堆上释放空间
-inline static void SystemFree(void *ptr) {
+// 堆上申请空间，页号按8K计算，起始地址按8K对齐
+inline static void *SystemAlloc(size_t kpage) {
+    return SystemAllocAligned(kpage, (size_t) 1 << PAGE_SHIFT);
+}
+
+// 把物理页还给系统，虚拟地址保留，再次访问时内核重新分配全0的页
+// 返回是否成功（例如hugetlb的页不能只还一部分）
+inline static bool SystemRelease(void *ptr, size_t kpage) {
+#ifdef _WIN32
+    return VirtualFree(ptr, kpage << PAGE_SHIFT, MEM_DECOMMIT)
+           && VirtualAlloc(ptr, kpage << PAGE_SHIFT, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+    return madvise(ptr, kpage << PAGE_SHIFT, MADV_DONTNEED) == 0;
+#endif
+}
+
+// 环境变量name为"1"时返回true，用于打开可选的功能
+inline static bool EnvEnabled(const char *name) {
+    const char *env = getenv(name);
+    return env != nullptr && env[0] == '1';
+}
+
+// 单调时钟，毫秒
+inline static uint64_t NowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// 堆上释放kpage页空间，可以是一次申请的一部分，也可以跨相邻的几次申请
+inline static void SystemFree(void *ptr, size_t kpage) {
 #ifdef _WIN32
-    VirtualFree(ptr, 0, MEM_RELEASE);
+    // MEM_RELEASE只能整块释放当初申请的区域，这里只把物理内存还回去
+    VirtualFree(ptr, kpage << PAGE_SHIFT, MEM_DECOMMIT);
 #else
-    munmap(ptr, 0);
+    munmap(ptr, kpage << PAGE_SHIFT);
 #endif
 }
 
+// ObjectPool依赖上面的SystemAlloc，放在最后包含
+#include "ObjectPool.h"
+
 #endif //MEMORY_POOL_COMMON_H